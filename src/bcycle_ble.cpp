@@ -1,6 +1,7 @@
 #include "Particle.h"
 #include "bike_canbus.h"
 #include "bcycle_ble.h"
+#include "bike_range.h"
 
 BCycleBLE *BCycleBLE::_instance = nullptr;
 
@@ -24,6 +25,7 @@ BCycleBLE *BCycleBLE::_instance = nullptr;
 #define SERNUM_CHAR_UUID        0x3003  // Read
 #define FWVERSION_CHAR_UUID     0x3004  // Read
 #define CONTROL_CHAR_UUID       0x3005  // Notify, read, write (unimplemented for now)
+#define RANGE_CHAR_UUID         0x3006  // Notify, read; ours, not in the BBT firmware
 
 // Set up our service and characteristc UUIDs
 const uint8_t BASE_UUID[BLE_SIG_UUID_128BIT_LEN] = TREK_BLE_BASE_UUID;
@@ -32,12 +34,14 @@ BleUuid charBatteryUUID     (BASE_UUID, BATTERY_CHAR_UUID);
 BleUuid charOdometerUUID    (BASE_UUID, ODOMETER_CHAR_UUID);
 BleUuid charSerNumUUID      (BASE_UUID, SERNUM_CHAR_UUID);
 BleUuid charFwVerUUID       (BASE_UUID, FWVERSION_CHAR_UUID);
+BleUuid charRangeUUID       (BASE_UUID, RANGE_CHAR_UUID);
 
 // Set up characteristics
 BleCharacteristic charBattery   ("Battery",         BleCharacteristicProperty::READ | BleCharacteristicProperty::NOTIFY, charBatteryUUID,  genericServiceUUID);
 BleCharacteristic charOdometer  ("Odometer",        BleCharacteristicProperty::READ | BleCharacteristicProperty::NOTIFY, charOdometerUUID, genericServiceUUID);
 BleCharacteristic charSerNum    ("Serial Number",   BleCharacteristicProperty::READ,                                     charSerNumUUID,   genericServiceUUID);
 BleCharacteristic charFwVer     ("fw version",      BleCharacteristicProperty::READ,                                     charFwVerUUID,    genericServiceUUID);
+BleCharacteristic charRange     ("Range",           BleCharacteristicProperty::READ | BleCharacteristicProperty::NOTIFY, charRangeUUID,    genericServiceUUID);
 
 void BCycleBLE::setup() {
 
@@ -51,6 +55,7 @@ void BCycleBLE::setup() {
     BLE.addCharacteristic(charOdometer);
     BLE.addCharacteristic(charSerNum);
     BLE.addCharacteristic(charFwVer);
+    BLE.addCharacteristic(charRange);
 
     // Set initial values for static values
     charSerNum.setValue((uint8_t *)sernumstring, strlen(sernumstring));
@@ -59,6 +64,7 @@ void BCycleBLE::setup() {
     // Set initial values for dynamic values
     charBattery.setValue("0");
     charOdometer.setValue("0");
+    charRange.setValue("-");
 
     // Advertising setup: device name and our generic service UUID
     BleAdvertisingData advData;
@@ -71,16 +77,42 @@ void BCycleBLE::setup() {
 }
 
 void BCycleBLE::loop() {
+    // Fields go stale without any new data arriving, so look for that as well
+    bool fresh = BikeCANBus::instance().getBikeData(_data, _data_cursor);
+    uint32_t stale = BikeCANBus::getStaleFields(_data, millis());
+    if (fresh || stale != _stale) {
+        _stale = stale;
+        updateData(_data, stale);
+    }
 }
 
-void BCycleBLE::updateData(bike_data_t &data) {
+// Stale fields are sent as "-" in the same width, so the app can tell them from real values
+void BCycleBLE::updateData(bike_data_t &data, uint32_t stale) {
     static char valueStr[20] = {0};
     
     memset(valueStr, 0, 20);
-    sprintf(valueStr, "% 4d", data.battery_pct);
+    if (BikeCANBus::isFieldStale(stale, BIKE_DATA_BATTERY_PCT)) {
+        sprintf(valueStr, "%4s", "-");
+    } else {
+        sprintf(valueStr, "% 4d", data.battery_pct);
+    }
     charBattery.setValue(valueStr);
 
     memset(valueStr, 0, 20);
-    sprintf(valueStr, "% 12ld", data.odometer);
+    if (BikeCANBus::isFieldStale(stale, BIKE_DATA_ODOMETER)) {
+        sprintf(valueStr, "%12s", "-");
+    } else {
+        sprintf(valueStr, "% 12ld", data.odometer);
+    }
     charOdometer.setValue(valueStr);
+
+    // Predicted range in whole km
+    memset(valueStr, 0, 20);
+    float range_km = BikeRange::instance().getRangeKm(data, stale);
+    if (range_km < 0.0f) {
+        sprintf(valueStr, "%4s", "-");
+    } else {
+        sprintf(valueStr, "% 4d", (int)lroundf(range_km));
+    }
+    charRange.setValue(valueStr);
 }
\ No newline at end of file
@@ -15,12 +15,16 @@ class BCycleBLE {
             return *_instance;
         }
 
-        BCycleBLE() {};
+        BCycleBLE() : _data_cursor(0), _stale(0) {};
 
         void setup();
         void loop();
-        void updateData(bike_data_t &data);
+        void updateData(bike_data_t &data, uint32_t stale);
 
     private:
         static BCycleBLE *_instance;
+
+        bike_data_t _data;
+        uint32_t _data_cursor;      // Version of the bike data last pushed to the characteristics
+        uint32_t _stale;            // Stale fields as of the last push
 };
\ No newline at end of file
@@ -0,0 +1,277 @@
+#include "Particle.h"
+#include "bike_battery.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <stddef.h>
+
+BikeBattery *BikeBattery::_instance = nullptr;
+
+Logger bike_battery("app.bike_battery");
+
+#define BIKE_BATTERY_MAGIC              (0x42425432)    // "BBT2"
+#define BIKE_BATTERY_MAGIC_V1           (0x42425431)    // "BBT1", without last_seen
+
+void BikeBattery::setup() {
+    int fd = open(BIKE_BATTERY_FILE, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    bike_battery_history_t history;
+    memset(&history, 0, sizeof(history));
+    ssize_t len = read(fd, &history, sizeof(history));
+    bool ok = ((history.magic == BIKE_BATTERY_MAGIC && len == sizeof(history)) ||
+               (history.magic == BIKE_BATTERY_MAGIC_V1 && len == offsetof(bike_battery_history_t, last_seen))) &&
+        history.head < BIKE_BATTERY_RECORDS && history.count <= BIKE_BATTERY_RECORDS;
+    close(fd);
+
+    if (!ok) {
+        bike_battery.warn("Ignoring invalid %s", BIKE_BATTERY_FILE);
+        return;
+    }
+    _history = history;
+    bike_battery.info("Loaded %u records, %lu.%02lu cycles", _history.count, _history.charged_pct / 100, _history.charged_pct % 100);
+}
+
+void BikeBattery::save() {
+    _history.magic = BIKE_BATTERY_MAGIC;
+    int fd = open(BIKE_BATTERY_FILE, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0 || write(fd, &_history, sizeof(_history)) != sizeof(_history)) {
+        bike_battery.error("Unable to save battery history to %s", BIKE_BATTERY_FILE);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void BikeBattery::add(const bike_battery_record_t &record) {
+    _history.records[_history.head] = record;
+    _history.head = (_history.head + 1) % BIKE_BATTERY_RECORDS;
+    if (_history.count < BIKE_BATTERY_RECORDS) {
+        _history.count++;
+    }
+}
+
+void BikeBattery::loop() {
+    if (millis() - _last_poll_ms >= BIKE_BATTERY_POLL_MS) {
+        _last_poll_ms = millis();
+        poll();
+    }
+    publishDaily();
+}
+
+void BikeBattery::start() {
+    _riding = true;
+    _ride_valid = false;
+    _charging = false;
+    _ride_time = Time.isValid() ? Time.now() : 0;
+    poll();
+}
+
+void BikeBattery::end() {
+    if (!_riding) {
+        return;
+    }
+    _riding = false;
+
+    if (_ride_valid && _ride_end_odometer >= _ride_odometer + BIKE_BATTERY_MIN_RIDE_M) {
+        bike_battery_record_t record;
+        memset(&record, 0, sizeof(record));
+        record.time = (uint32_t)_ride_time;
+        record.type = BIKE_BATTERY_RECORD_RIDE;
+        record.pct_start = _ride_pct;
+        record.pct_end = _ride_end_pct;
+        record.cycles_dc = (uint16_t)(_history.charged_pct / 10);
+        record.distance_m = _ride_end_odometer - _ride_odometer;
+        record.duration_s = (_ride_end_ms - _ride_start_ms) / 1000;
+        add(record);
+    }
+    // Also keeps the last level, so a charge before the next ride is noticed after a reboot
+    save();
+}
+
+void BikeBattery::poll() {
+    bike_data_t data;
+    BikeCANBus::instance().getBikeData(data);
+    long unsigned int now = millis();
+    uint32_t stale = BikeCANBus::getStaleFields(data, now);
+    if (BikeCANBus::isFieldStale(stale, BIKE_DATA_BATTERY_PCT)) {
+        return;
+    }
+
+    uint8_t pct = data.battery_pct;
+    uint16_t capacity_dah = BikeCANBus::isFieldStale(stale, BIKE_DATA_BATTERY_CAPACITY) ? 0 : (uint16_t)lroundf(data.battery_capacity * 10.0f);
+    // The pack went full after we last saw the level if its time since full is the shorter of the two
+    uint32_t now_s = Time.isValid() ? (uint32_t)Time.now() : 0;
+    bool full = (pct >= 100) || (now_s && _history.last_seen && now_s > _history.last_seen &&
+        !BikeCANBus::isFieldStale(stale, BIKE_DATA_BATTERY_TIME_SINCE_FULL) && data.battery_time_since_full < now_s - _history.last_seen);
+
+    if (_history.last_pct == 0xff || pct < _history.last_pct) {
+        _history.last_pct = pct;
+        _charging = false;
+    } else if (pct >= _history.last_pct + BIKE_BATTERY_MIN_CHARGE_PCT) {
+        _history.charged_pct += pct - _history.last_pct;
+        if (_charging) {
+            // Still the same charge, seen while awake: extend its record
+            bike_battery_record_t &record = _history.records[(_history.head + BIKE_BATTERY_RECORDS - 1) % BIKE_BATTERY_RECORDS];
+            record.pct_end = pct;
+            record.cycles_dc = (uint16_t)(_history.charged_pct / 10);
+            if (capacity_dah) {
+                record.capacity_dah = capacity_dah;
+            }
+            if (full && !record.full) {
+                record.full = 1;
+                _history.full_charges++;
+            }
+        } else {
+            bike_battery_record_t record;
+            memset(&record, 0, sizeof(record));
+            record.time = Time.isValid() ? (uint32_t)Time.now() : 0;
+            record.type = BIKE_BATTERY_RECORD_CHARGE;
+            record.pct_start = _history.last_pct;
+            record.pct_end = pct;
+            record.full = full ? 1 : 0;
+            record.capacity_dah = capacity_dah;
+            record.cycles_dc = (uint16_t)(_history.charged_pct / 10);
+            add(record);
+            if (full) {
+                _history.full_charges++;
+            }
+            _charging = true;
+        }
+        if (full && capacity_dah && !_history.first_capacity_dah) {
+            _history.first_capacity_dah = capacity_dah;
+        }
+        bike_battery.info("Charge %u%% -> %u%%%s", _history.last_pct, pct, full ? " (full)" : "");
+        _history.last_pct = pct;
+        _history.last_seen = now_s;
+        save();
+    }
+    if (pct == _history.last_pct) {
+        _history.last_seen = now_s;
+    }
+
+    if (_riding && !BikeCANBus::isFieldStale(stale, BIKE_DATA_ODOMETER)) {
+        if (!_ride_valid) {
+            _ride_valid = true;
+            _ride_pct = pct;
+            _ride_odometer = data.odometer;
+            _ride_start_ms = now;
+        }
+        _ride_end_pct = pct;
+        _ride_end_odometer = data.odometer;
+        _ride_end_ms = now;
+    }
+}
+
+// {"cyc":41.3,"full":35,"cap":13.1,"cap0":13.4,"soh":98,"cap_tr":-0.42,"dr":1.94,"dr_old":1.81,"dh":21.5,"n":[12,20]}
+// cyc: equivalent full cycles. cap: reported capacity at the latest full charges (Ah), cap0 the
+// first, soh the ratio (%). cap_tr: capacity trend over the ring (Ah per 100 cycles). dr, dr_old:
+// discharge (%/km) over the newer and older half of the rides in the ring; dh: newer half in %/h.
+// n: charge and ride records in the ring.
+size_t BikeBattery::writeJSON(char *buf, size_t size) {
+    size_t charges = 0, rides = 0;
+    for (size_t i = 0; i < _history.count; i++) {
+        if (_history.records[i].type == BIKE_BATTERY_RECORD_CHARGE) {
+            charges++;
+        } else {
+            rides++;
+        }
+    }
+
+    // Capacity at full charge: latest few, and a least-squares slope against cycles
+    float cap_sum = 0.0f;
+    size_t cap_recent = 0;
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    // Ride discharge: newer and older half
+    uint32_t drop[2] = { 0, 0 }, dist_m[2] = { 0, 0 }, dur_s[2] = { 0, 0 };
+    size_t ride = 0;
+
+    for (size_t i = 0; i < _history.count; i++) {
+        // Newest first
+        const bike_battery_record_t &record = _history.records[(_history.head + BIKE_BATTERY_RECORDS - 1 - i) % BIKE_BATTERY_RECORDS];
+        if (record.type == BIKE_BATTERY_RECORD_CHARGE) {
+            if (!record.full || !record.capacity_dah) {
+                continue;
+            }
+            double x = record.cycles_dc / 10.0, y = record.capacity_dah / 10.0;
+            n++; sx += x; sy += y; sxx += x * x; sxy += x * y;
+            if (cap_recent < 3) {
+                cap_sum += (float)y;
+                cap_recent++;
+            }
+        } else {
+            size_t half = (ride++ < (rides + 1) / 2) ? 0 : 1;
+            if (record.pct_start > record.pct_end) {
+                drop[half] += record.pct_start - record.pct_end;
+            }
+            dist_m[half] += record.distance_m;
+            dur_s[half] += record.duration_s;
+        }
+    }
+
+    memset(buf, 0, size);
+    JSONBufferWriter writer(buf, size - 1);
+    writer.beginObject();
+    writer.name("cyc").value((float)_history.charged_pct / 100.0f, 1);
+    writer.name("full").value((unsigned int)_history.full_charges);
+    if (cap_recent) {
+        float cap = cap_sum / (float)cap_recent;
+        writer.name("cap").value(cap, 1);
+        if (_history.first_capacity_dah) {
+            float cap0 = _history.first_capacity_dah / 10.0f;
+            writer.name("cap0").value(cap0, 1);
+            writer.name("soh").value((int)lroundf(cap / cap0 * 100.0f));
+        }
+    }
+    double var = n * sxx - sx * sx;
+    if (n >= 3 && var > 0.0) {
+        writer.name("cap_tr").value((float)((n * sxy - sx * sy) / var * 100.0), 2);
+    }
+    if (dist_m[0]) {
+        writer.name("dr").value((float)drop[0] / ((float)dist_m[0] / 1000.0f), 2);
+    }
+    if (dist_m[1]) {
+        writer.name("dr_old").value((float)drop[1] / ((float)dist_m[1] / 1000.0f), 2);
+    }
+    if (dur_s[0]) {
+        writer.name("dh").value((float)drop[0] / ((float)dur_s[0] / 3600.0f), 1);
+    }
+    writer.name("n").beginArray();
+    writer.value((unsigned int)charges);
+    writer.value((unsigned int)rides);
+    writer.endArray();
+    writer.endObject();
+    return writer.dataSize();
+}
+
+void BikeBattery::publishDaily() {
+    if (_publishing) {
+        if (!_publish.isDone()) {
+            return;
+        }
+        _publishing = false;
+        if (_publish.isSucceeded()) {
+            _history.last_publish = (uint32_t)Time.now();
+            save();
+        } else {
+            bike_battery.warn("Battery publish failed, retrying later");
+            _retry_ms = millis() + BIKE_BATTERY_RETRY_MS;
+        }
+        return;
+    }
+
+    if (!_history.count || !Time.isValid() || !Particle.connected() || (long)(millis() - _retry_ms) < 0) {
+        return;
+    }
+    if (_history.last_publish && (uint32_t)Time.now() - _history.last_publish < BIKE_BATTERY_PUBLISH_S) {
+        return;
+    }
+
+    static char buf[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+    writeJSON(buf, sizeof(buf));
+    bike_battery.info("Battery health: %s", buf);
+    _publish = Particle.publish("battery", buf, WITH_ACK);
+    _publishing = true;
+}
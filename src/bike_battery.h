@@ -0,0 +1,117 @@
+// Battery health history, published as a daily "battery" event
+//
+// The decoded battery fields are looked at every few seconds, never per frame. A rise in the
+// battery level since it was last seen counts as a charge, and is added to the equivalent full
+// cycles together with the capacity the pack reported. The charge reached full if the pack's time
+// since full is shorter than the time since the level was last seen, or the level is 100%. Every ride adds its start and end level,
+// distance and duration. Records go into a small ring that is kept in flash, and once a day the
+// trends are worked out from it: capacity against cycles, and discharge per km recently against
+// earlier.
+#pragma once
+
+#include "Particle.h"
+#include "bike_canbus.h"
+
+#define BIKE_BATTERY_RECORDS            (32)        // Ring size; older records are overwritten
+#define BIKE_BATTERY_POLL_MS            (10000)
+#define BIKE_BATTERY_MIN_CHARGE_PCT     (2)         // Smaller rises are taken as gauge jitter
+#define BIKE_BATTERY_MIN_RIDE_M         (1000)      // Shorter rides are not used for discharge rates
+#define BIKE_BATTERY_PUBLISH_S          (24*60*60)
+#define BIKE_BATTERY_RETRY_MS           (10*60*1000)
+#define BIKE_BATTERY_FILE               "/usr/bike_battery"
+
+typedef enum : uint8_t {
+    BIKE_BATTERY_RECORD_CHARGE,
+    BIKE_BATTERY_RECORD_RIDE,
+} bike_battery_record_type_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t time;                  // Epoch, 0 if the time was not known
+    bike_battery_record_type_t type;
+    uint8_t pct_start;
+    uint8_t pct_end;
+    uint8_t full;                   // CHARGE: the charge went all the way
+    uint16_t capacity_dah;          // CHARGE: reported capacity, 0.1 Ah, 0 if not received
+    uint16_t cycles_dc;             // Equivalent full cycles so far, 0.1 cycles
+    uint32_t distance_m;            // RIDE
+    uint32_t duration_s;            // RIDE
+} bike_battery_record_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t charged_pct;           // Sum of all charges, 100 per equivalent full cycle
+    uint32_t full_charges;
+    uint16_t first_capacity_dah;    // First capacity reported at a full charge, for state of health
+    uint8_t last_pct;               // Battery level when last seen, 0xff if never
+    uint8_t head;                   // Next record slot
+    uint8_t count;
+    uint8_t reserved[3];
+    uint32_t last_publish;          // Epoch of the last daily publish
+    bike_battery_record_t records[BIKE_BATTERY_RECORDS];
+    uint32_t last_seen;             // Epoch last_pct was last seen at, 0 if not known. Older files end before it
+} bike_battery_history_t;
+
+class BikeBattery {
+    public:
+        static BikeBattery &instance()
+        {
+            if(!_instance)
+            {
+                _instance = new BikeBattery();
+            }
+            return *_instance;
+        }
+
+        void setup();
+        void loop();
+
+        // Driven by the bike state machine
+        void start();
+        void end();
+
+    private:
+        BikeBattery() :
+            _last_poll_ms(0),
+            _charging(false),
+            _riding(false),
+            _ride_valid(false),
+            _ride_pct(0),
+            _ride_odometer(0),
+            _ride_start_ms(0),
+            _ride_end_ms(0),
+            _ride_end_pct(0),
+            _ride_end_odometer(0),
+            _ride_time(0),
+            _publishing(false),
+            _retry_ms(0)
+        {
+            memset(&_history, 0, sizeof(_history));
+            _history.last_pct = 0xff;
+        };
+
+        static BikeBattery *_instance;
+
+        bike_battery_history_t _history;
+        long unsigned int _last_poll_ms;
+        bool _charging;                 // The newest record is a charge still going on
+
+        bool _riding;
+        bool _ride_valid;               // Start of the ride was seen
+        uint8_t _ride_pct;
+        uint32_t _ride_odometer;
+        long unsigned int _ride_start_ms;
+        long unsigned int _ride_end_ms; // Last good sample of the ride
+        uint8_t _ride_end_pct;
+        uint32_t _ride_end_odometer;
+        time_t _ride_time;
+
+        particle::Future<bool> _publish;
+        bool _publishing;
+        long unsigned int _retry_ms;
+
+        void poll();
+        void add(const bike_battery_record_t &record);
+        void save();
+        void publishDaily();
+        size_t writeJSON(char *buf, size_t size);
+};
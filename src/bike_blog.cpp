@@ -0,0 +1,173 @@
+#include "Particle.h"
+#include "bike_blog.h"
+#include "bike_config.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+BikeBinLog *BikeBinLog::_instance = nullptr;
+
+Logger blog_log("app.blog");
+
+#define BIKE_BLOG_FORMAT(name, category, format)    category,
+const bike_blog_cat_t BikeBinLog::_categories[BIKE_BLOG_NUM_FORMATS] = {
+#include "bike_blog_formats.h"
+};
+#undef BIKE_BLOG_FORMAT
+
+BikeBinLog::BikeBinLog() :
+    _head(0),
+    _tail(0),
+    _dropped(0),
+    _dropped_total(0),
+    _sink(BIKE_BLOG_SINK_SERIAL),
+    _fd(-1),
+    _block_count(0),
+    _unsynced(false),
+    _last_sync_ms(0)
+{
+    for (size_t i = 0; i < BIKE_BLOG_NUM_CATS; i++) {
+        _levels[i] = LOG_LEVEL_INFO;
+    }
+}
+
+void BikeBinLog::write(LogLevel level, bike_blog_fmt_t fmt, uint8_t num_args, const uint32_t *args) {
+    long unsigned int now = millis();
+
+    // Producers are the application and the CAN thread; masking interrupts for a 24 byte copy is
+    // cheaper than taking a mutex
+    ATOMIC_BLOCK() {
+        if (_head - _tail >= BIKE_BLOG_RING_SIZE) {
+            _dropped++;
+        } else {
+            bike_blog_record_t &record = _ring[_head % BIKE_BLOG_RING_SIZE];
+            record.time_ms = now;
+            record.fmt = fmt;
+            record.level = (uint8_t)level;
+            record.num_args = num_args;
+            memcpy(record.args, args, sizeof(record.args));
+            _head++;
+        }
+    }
+}
+
+void BikeBinLog::loop() {
+    // Follow the runtime levels and sink from the bike config
+    BikeConfig &config = BikeConfig::instance();
+    for (size_t i = 0; i < BIKE_BLOG_NUM_CATS; i++) {
+        _levels[i] = (LogLevel)config.getBinLogLevel((bike_blog_cat_t)i);
+    }
+    bike_blog_sink_t sink = (bike_blog_sink_t)config.getBinLogSink();
+    if (sink != _sink && _sink == BIKE_BLOG_SINK_FLASH) {
+        sync();
+        if (_fd >= 0) {
+            close(_fd);
+            _fd = -1;
+        }
+    }
+    _sink = sink;
+
+    uint32_t dropped = 0;
+    ATOMIC_BLOCK() {
+        dropped = _dropped;
+        _dropped = 0;
+    }
+    if (dropped) {
+        _dropped_total += dropped;
+        bike_blog_record_t record = { (uint32_t)millis(), BLOG_DROPPED, (uint8_t)LOG_LEVEL_WARN, 1, { dropped, 0, 0, 0 } };
+        writeOut(record);
+    }
+
+    // The slot at _tail is not touched by producers until _tail moves past it
+    for (unsigned int i = 0; i < BIKE_BLOG_DRAIN_MAX && _tail != _head; i++) {
+        writeOut(_ring[_tail % BIKE_BLOG_RING_SIZE]);
+        _tail = _tail + 1;
+    }
+
+    if (millis() - _last_sync_ms >= BIKE_BLOG_SYNC_MS) {
+        sync();
+    }
+}
+
+void BikeBinLog::writeOut(const bike_blog_record_t &record) {
+    if (_sink != BIKE_BLOG_SINK_FLASH) {
+        writeSerial(record);
+        return;
+    }
+
+    _block[_block_count++] = record;
+    if (_block_count >= BIKE_BLOG_BLOCK_RECORDS) {
+        writeBlock();
+    }
+}
+
+// Write out the collected records in one go. Whole records only, so rotation never splits one.
+void BikeBinLog::writeBlock() {
+    if (!_block_count) {
+        return;
+    }
+
+    size_t size = _block_count * sizeof(bike_blog_record_t);
+    if (openFile()) {
+        if (::write(_fd, _block, size) == (ssize_t)size) {
+            _unsynced = true;
+            _block_count = 0;
+            return;
+        }
+        blog_log.error("Write to %s failed", BIKE_BLOG_FILE);
+        close(_fd);
+        _fd = -1;
+    }
+
+    // Records fall back to the serial log while the file cannot be written
+    for (size_t i = 0; i < _block_count; i++) {
+        writeSerial(_block[i]);
+    }
+    _block_count = 0;
+}
+
+// Write out a partial block and commit the file, so at most BIKE_BLOG_SYNC_MS of records are
+// lost to a reset
+void BikeBinLog::sync() {
+    _last_sync_ms = millis();
+    writeBlock();
+    if (_unsynced && _fd >= 0) {
+        fsync(_fd);
+    }
+    _unsynced = false;
+}
+
+void BikeBinLog::writeSerial(const bike_blog_record_t &record) {
+    char hex[sizeof(record) * 2 + 1];
+    const uint8_t *bytes = (const uint8_t *)&record;
+    for (size_t i = 0; i < sizeof(record); i++) {
+        snprintf(&hex[i * 2], 3, "%02x", bytes[i]);
+    }
+    blog_log.info("BL %s", hex);
+}
+
+// Open the log file for appending, rotating it once it reaches BIKE_BLOG_FILE_MAX
+bool BikeBinLog::openFile() {
+    if (_fd < 0) {
+        _fd = open(BIKE_BLOG_FILE, O_WRONLY | O_CREAT | O_APPEND);
+        if (_fd < 0) {
+            static bool logged = false;
+            if (!logged) {
+                logged = true;
+                blog_log.error("Unable to open %s (%d)", BIKE_BLOG_FILE, errno);
+            }
+            return false;
+        }
+    }
+
+    // From the end, so a file left over from before a reboot is rotated too
+    if (lseek(_fd, 0, SEEK_END) < BIKE_BLOG_FILE_MAX) {
+        return true;
+    }
+
+    close(_fd);
+    unlink(BIKE_BLOG_FILE_OLD);
+    rename(BIKE_BLOG_FILE, BIKE_BLOG_FILE_OLD);
+    _fd = open(BIKE_BLOG_FILE, O_WRONLY | O_CREAT | O_APPEND);
+    return _fd >= 0;
+}
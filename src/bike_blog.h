@@ -0,0 +1,151 @@
+// Deferred binary log for the CAN hot paths
+//
+// A call site stores a format ID, a level and up to four 32-bit arguments in a RAM ring. Nothing is
+// formatted on the way in; loop() later drains the ring to the serial log (one hex line per record)
+// or to a file in flash, and tools/bike_blog_decode.py rebuilds the text on the host. That keeps
+// trace-level CAN logging cheap enough to leave enabled. The flash sink collects records into a
+// block and writes it out whole, syncing the file every few seconds rather than per record.
+#pragma once
+
+#include <string.h>
+#include <type_traits>
+
+#include "Particle.h"
+
+// Categories each have their own runtime level, set through the "blog" object of the bike config
+typedef enum : uint8_t {
+    BIKE_BLOG_CAT_CAN,              // app.bike_can
+    BIKE_BLOG_CAT_CAN_RAW,          // app.bike_can.raw
+    BIKE_BLOG_CAT_MCP,              // app.mcp25625
+    BIKE_BLOG_NUM_CATS
+} bike_blog_cat_t;
+
+#define BIKE_BLOG_FORMAT(name, category, format)    name,
+typedef enum : uint16_t {
+#include "bike_blog_formats.h"
+    BIKE_BLOG_NUM_FORMATS
+} bike_blog_fmt_t;
+#undef BIKE_BLOG_FORMAT
+
+typedef enum : uint8_t {
+    BIKE_BLOG_SINK_SERIAL,          // Hex lines through the "app.blog" logger
+    BIKE_BLOG_SINK_FLASH,           // Raw records appended to BIKE_BLOG_FILE a block at a time
+} bike_blog_sink_t;
+
+#define BIKE_BLOG_RING_SIZE             128     // Records, 24 bytes each
+#define BIKE_BLOG_MAX_ARGS              4
+#define BIKE_BLOG_DRAIN_MAX             16      // Records written out per call to loop()
+#define BIKE_BLOG_FILE                  "/usr/blog.bin"
+#define BIKE_BLOG_FILE_OLD              "/usr/blog.1.bin"
+#define BIKE_BLOG_FILE_MAX              (64*1024)   // Rotated to BIKE_BLOG_FILE_OLD at this size
+#define BIKE_BLOG_BLOCK_RECORDS         (42)        // Records per flash write, just under 1 KB
+#define BIKE_BLOG_SYNC_MS               (5000)      // A partial block is written and synced this often
+
+// On-the-wire record, also the layout in flash. Little endian.
+typedef struct __attribute__((packed)) {
+    uint32_t time_ms;
+    uint16_t fmt;                   // bike_blog_fmt_t
+    uint8_t level;                  // LogLevel
+    uint8_t num_args;
+    uint32_t args[BIKE_BLOG_MAX_ARGS];
+} bike_blog_record_t;
+
+class BikeBinLog {
+    public:
+        static BikeBinLog &instance()
+        {
+            if(!_instance)
+            {
+                _instance = new BikeBinLog();
+            }
+            return *_instance;
+        }
+
+        void loop();
+
+        inline bool isEnabled(bike_blog_fmt_t fmt, LogLevel level) const {
+            return level >= _levels[_categories[fmt]];
+        }
+
+        // Safe from any thread. Integer and float arguments only.
+        template <typename... Args>
+        inline void log(LogLevel level, bike_blog_fmt_t fmt, Args... args) {
+            static_assert(sizeof...(Args) <= BIKE_BLOG_MAX_ARGS, "Too many binary log arguments");
+            if (!isEnabled(fmt, level)) {
+                return;
+            }
+            uint32_t words[BIKE_BLOG_MAX_ARGS] = { toWord(args)... };
+            write(level, fmt, sizeof...(Args), words);
+        }
+
+        template <typename... Args>
+        inline void trace(bike_blog_fmt_t fmt, Args... args) {
+            log(LOG_LEVEL_TRACE, fmt, args...);
+        }
+
+        template <typename... Args>
+        inline void info(bike_blog_fmt_t fmt, Args... args) {
+            log(LOG_LEVEL_INFO, fmt, args...);
+        }
+
+        template <typename... Args>
+        inline void warn(bike_blog_fmt_t fmt, Args... args) {
+            log(LOG_LEVEL_WARN, fmt, args...);
+        }
+
+        template <typename... Args>
+        inline void error(bike_blog_fmt_t fmt, Args... args) {
+            log(LOG_LEVEL_ERROR, fmt, args...);
+        }
+
+        inline void setLevel(bike_blog_cat_t category, LogLevel level) {
+            _levels[category] = level;
+        }
+
+        inline void setSink(bike_blog_sink_t sink) {
+            _sink = sink;
+        }
+
+        inline uint32_t getDropped() const {
+            return _dropped_total;
+        }
+
+    private:
+        BikeBinLog();
+
+        static BikeBinLog *_instance;
+        static const bike_blog_cat_t _categories[BIKE_BLOG_NUM_FORMATS];
+
+        bike_blog_record_t _ring[BIKE_BLOG_RING_SIZE];
+        volatile uint32_t _head;            // Written by producers with interrupts masked
+        volatile uint32_t _tail;            // Only advanced by loop()
+        volatile uint32_t _dropped;         // Since the last BLOG_DROPPED record
+        uint32_t _dropped_total;
+        volatile LogLevel _levels[BIKE_BLOG_NUM_CATS];
+        bike_blog_sink_t _sink;
+        int _fd;
+        bike_blog_record_t _block[BIKE_BLOG_BLOCK_RECORDS];    // Flash sink records not yet written
+        size_t _block_count;
+        bool _unsynced;                     // Written since the last fsync()
+        long unsigned int _last_sync_ms;
+
+        void write(LogLevel level, bike_blog_fmt_t fmt, uint8_t num_args, const uint32_t *args);
+        void writeOut(const bike_blog_record_t &record);
+        void writeSerial(const bike_blog_record_t &record);
+        void writeBlock();
+        void sync();
+        bool openFile();
+
+        template <typename T>
+        static inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, uint32_t>::type toWord(T value) {
+            return (uint32_t)value;
+        }
+
+        template <typename T>
+        static inline typename std::enable_if<std::is_floating_point<T>::value, uint32_t>::type toWord(T value) {
+            float f = (float)value;
+            uint32_t word;
+            memcpy(&word, &f, sizeof(word));
+            return word;
+        }
+};
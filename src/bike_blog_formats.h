@@ -0,0 +1,15 @@
+// Format strings for the binary log
+//
+// Records carry the index of their entry here instead of text, so entries are only ever added at
+// the end; tools/bike_blog_decode.py reads this file to turn records back into text. Arguments are
+// 32-bit words: %f/%e/%g take a float, everything else an integer. No %s.
+//
+// BIKE_BLOG_FORMAT(name, category, format)
+
+BIKE_BLOG_FORMAT(BLOG_DROPPED,          BIKE_BLOG_CAT_CAN,      "Binary log dropped %lu record(s)")
+BIKE_BLOG_FORMAT(BLOG_CAN_FRAME,        BIKE_BLOG_CAT_CAN_RAW,  "%08lx:%u %08lx %08lx")
+BIKE_BLOG_FORMAT(BLOG_CAN_UNKNOWN,      BIKE_BLOG_CAT_CAN_RAW,  "Unknown Frame: 0x%04lX (%u bytes)")
+BIKE_BLOG_FORMAT(BLOG_MCP_INT_EMPTY,    BIKE_BLOG_CAT_MCP,      "INT triggered, no messages: {CANINTE: 0x%02X, CANINTF: 0x%02X}")
+BIKE_BLOG_FORMAT(BLOG_MCP_RX_OVERFLOW,  BIKE_BLOG_CAT_MCP,      "RX Buffer(s) full: {0: %u, 1: %u}, clearing error")
+BIKE_BLOG_FORMAT(BLOG_CAN_TX_OK,        BIKE_BLOG_CAT_CAN,      "TX 0x%03lX SUCCESS (%u sent)")
+BIKE_BLOG_FORMAT(BLOG_CAN_TX_FAIL,      BIKE_BLOG_CAT_CAN,      "TX 0x%03lX FAIL: result %u (%u sent)")
@@ -0,0 +1,124 @@
+// Learns how often the bike sends its periodic frames and uses that to decide when the bus has
+// gone quiet
+//
+// Each tracked ID keeps a running estimate of its period and jitter. The fastest ID with a settled
+// estimate is the heartbeat: the bus is idle once nothing at all has been received for
+// miss_periods of its period (plus jitter). Until something is learned, and as an upper bound,
+// the caller's fixed timeout applies.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define BIKE_CAN_ACTIVITY_MAX_IDS       8       // Key IDs tracked
+#define BIKE_CAN_ACTIVITY_MIN_SAMPLES   8       // Intervals seen before an ID's period is trusted
+#define BIKE_CAN_ACTIVITY_MAX_PERIOD_MS 2000    // Longer gaps are pauses or sleeps, not the frame's period
+#define BIKE_CAN_ACTIVITY_MIN_TIMEOUT_MS 100    // Never call the bus idle faster than this
+#define BIKE_CAN_ACTIVITY_JITTER_MULT   4       // Deviations of slack added to the timeout
+
+class BikeCANActivity {
+    public:
+        BikeCANActivity() : _num_ids(0) {};
+
+        // Add id to the set whose period is learned. Returns false if the table is full.
+        bool track(uint16_t id) {
+            if (find(id)) {
+                return true;
+            }
+            if (_num_ids >= BIKE_CAN_ACTIVITY_MAX_IDS) {
+                return false;
+            }
+            _ids[_num_ids++] = { id, 0, 0, 0, 0 };
+            return true;
+        }
+
+        // Feed every received frame, in order, with its receive time
+        void frame(long unsigned int id, long unsigned int rx_ms) {
+            entry_t *entry = find(id);
+            if (!entry) {
+                return;
+            }
+
+            long unsigned int gap = rx_ms - entry->last_ms;
+            if (entry->last_ms && gap > 0 && gap <= BIKE_CAN_ACTIVITY_MAX_PERIOD_MS) {
+                // Fixed point (1/16 ms) moving averages of the period and of the deviation from it
+                int32_t gap_q4 = (int32_t)gap << 4;
+                if (entry->samples == 0) {
+                    entry->period_q4 = gap_q4;
+                } else {
+                    int32_t err = gap_q4 - entry->period_q4;
+                    entry->period_q4 += err / 8;
+                    entry->dev_q4 += (abs(err) - entry->dev_q4) / 4;
+                }
+                if (entry->samples < UINT16_MAX) {
+                    entry->samples++;
+                }
+            }
+            entry->last_ms = rx_ms;
+        }
+
+        // Silence after the last frame that means the bus is idle
+        uint32_t timeoutMs(uint32_t miss_periods, uint32_t max_ms) const {
+            const entry_t *heartbeat = miss_periods ? this->heartbeat() : nullptr;
+            if (!heartbeat) {
+                return max_ms;
+            }
+
+            uint32_t timeout = ((uint32_t)heartbeat->period_q4 * miss_periods + (uint32_t)heartbeat->dev_q4 * BIKE_CAN_ACTIVITY_JITTER_MULT) >> 4;
+            if (timeout < BIKE_CAN_ACTIVITY_MIN_TIMEOUT_MS) {
+                return BIKE_CAN_ACTIVITY_MIN_TIMEOUT_MS;
+            }
+            if (timeout > max_ms) {
+                return max_ms;
+            }
+            return timeout;
+        }
+
+        // last_rx_ms is the newest frame received, which may not have been fed in yet
+        bool isIdle(long unsigned int now_ms, long unsigned int last_rx_ms, uint32_t miss_periods, uint32_t max_ms) const {
+            return now_ms - last_rx_ms > timeoutMs(miss_periods, max_ms);
+        }
+
+        // Fastest learned ID and its period in ms. Returns false if nothing is learned yet.
+        bool getHeartbeat(uint16_t &id, uint32_t &period_ms) const {
+            const entry_t *entry = heartbeat();
+            if (!entry) {
+                return false;
+            }
+            id = entry->id;
+            period_ms = (uint32_t)entry->period_q4 >> 4;
+            return true;
+        }
+
+    private:
+        typedef struct {
+            uint16_t id;
+            uint16_t samples;
+            long unsigned int last_ms;
+            int32_t period_q4;
+            int32_t dev_q4;
+        } entry_t;
+
+        entry_t _ids[BIKE_CAN_ACTIVITY_MAX_IDS];
+        size_t _num_ids;
+
+        entry_t *find(long unsigned int id) {
+            for (size_t i = 0; i < _num_ids; i++) {
+                if (_ids[i].id == id) {
+                    return &_ids[i];
+                }
+            }
+            return nullptr;
+        }
+
+        const entry_t *heartbeat() const {
+            const entry_t *best = nullptr;
+            for (size_t i = 0; i < _num_ids; i++) {
+                if (_ids[i].samples >= BIKE_CAN_ACTIVITY_MIN_SAMPLES && (!best || _ids[i].period_q4 < best->period_q4)) {
+                    best = &_ids[i];
+                }
+            }
+            return best;
+        }
+};
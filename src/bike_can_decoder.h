@@ -0,0 +1,255 @@
+// Table driven CAN signal decoder for bike_data_t
+//
+// Each signal is described by a row in a constexpr table. At compile time the decoder groups the
+// rows into messages, builds a lookup table from 11-bit CAN ID to message for the filter and
+// bookkeeping code, and generates the decode of each message with every offset, mask and scale
+// as a constant. tools/bike_can_decoder_bench.cpp checks it against the hand-written switch it
+// replaced.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <utility>
+
+#include "bike_data.h"
+
+#define BIKE_CAN_STD_ID_COUNT           (0x800)     // 11-bit identifiers
+
+typedef enum : uint8_t {
+    BIKE_FIELD_U8,
+    BIKE_FIELD_U32,
+    BIKE_FIELD_FLOAT,
+} bike_field_type_t;
+
+typedef enum : uint8_t {
+    BIKE_SIG_BIG_ENDIAN,
+    BIKE_SIG_LITTLE_ENDIAN,
+} bike_sig_order_t;
+
+// value = raw * mul / div + offset, computed in float for float fields and in integer math
+// otherwise, so integer fields stay exact over their full range. The integer form is picked per
+// row at compile time: a plain add, a shift for power of two divisors, 32-bit multiply and divide
+// when raw * mul cannot overflow, and 64-bit math (a library call on Cortex-M4) only when it can.
+typedef struct {
+    uint16_t id;                    // 11-bit CAN ID
+    uint8_t dlc;                    // Expected frame length; frames of any other length are ignored
+    uint8_t byte_offset;            // First byte of the signal in the frame
+    uint8_t length;                 // Signal length in bytes, 1-4
+    bike_sig_order_t order;
+    int32_t mul;
+    int32_t div;
+    int32_t offset;
+    uint8_t field_offset;           // offsetof() the target field in bike_data_t
+    bike_field_type_t field_type;
+    bike_data_field_t field;        // Target field's slot in bike_data_t::updated_ms
+    const char *name;
+} bike_can_signal_t;
+
+#define BIKE_FIELD(field, type, index)  (uint8_t)offsetof(bike_data_t, field), (type), (index)
+
+// Bosch drive unit signals, sorted by ID
+constexpr bike_can_signal_t bosch_can_signals[] = {
+    // Assist Level (4 bytes)
+    // [0]   Assist level
+    // [3:1] Unknown / 0
+    { 0x03B, 4, 0, 1, BIKE_SIG_BIG_ENDIAN, 1,   1, 0, BIKE_FIELD(pas_level, BIKE_FIELD_U8, BIKE_DATA_PAS_LEVEL), "pas_level" },
+
+    // Speed (2 bytes)
+    // [1:0] Speed in 0.01 km/h or 1/360 m/s
+    { 0x0D1, 2, 0, 2, BIKE_SIG_BIG_ENDIAN, 1, 100, 0, BIKE_FIELD(speed, BIKE_FIELD_FLOAT, BIKE_DATA_SPEED), "speed" },
+
+    // Charge Status (7 bytes)
+    // [4:0] Unknown
+    // [5]   Battery capacity, 0.1 Ah
+    // [6]   Battery percent, %
+    { 0x111, 7, 5, 1, BIKE_SIG_BIG_ENDIAN, 1,  10, 0, BIKE_FIELD(battery_capacity, BIKE_FIELD_FLOAT, BIKE_DATA_BATTERY_CAPACITY), "battery_capacity" },
+    { 0x111, 7, 6, 1, BIKE_SIG_BIG_ENDIAN, 1,   1, 0, BIKE_FIELD(battery_pct, BIKE_FIELD_U8, BIKE_DATA_BATTERY_PCT), "battery_pct" },
+
+    // Odometer Frame (8 bytes)
+    // [3:0] Odometer reading, meters
+    // [7:4] Unknown
+    { 0x202, 8, 0, 4, BIKE_SIG_BIG_ENDIAN, 1,   1, 0, BIKE_FIELD(odometer, BIKE_FIELD_U32, BIKE_DATA_ODOMETER), "odometer" },
+
+    // Battery (8 bytes)
+    // [3:0] Time since full, seconds
+    // [4]   Battery percent, % (same as 0x111)
+    // [5:7] Unknown
+    { 0x203, 8, 0, 4, BIKE_SIG_BIG_ENDIAN, 1,   1, 0, BIKE_FIELD(battery_time_since_full, BIKE_FIELD_U32, BIKE_DATA_BATTERY_TIME_SINCE_FULL), "battery_time_since_full" },
+};
+
+template <const auto &Signals>
+class BikeCANDecoder {
+    public:
+        static constexpr size_t N = sizeof(Signals) / sizeof(Signals[0]);
+        static_assert(N > 0 && N <= UINT8_MAX, "signal table size");
+
+        typedef struct {
+            uint16_t id;
+            uint8_t dlc;
+            uint8_t first_signal;
+            uint8_t num_signals;
+        } message_t;
+
+        // How a row's integer scaling is done
+        typedef enum : uint8_t {
+            BIKE_MATH_ADD,              // mul and div are 1
+            BIKE_MATH_SHIFT,            // mul is 1, div a power of two
+            BIKE_MATH_MUL_DIV32,        // raw * mul fits 32 bits for every raw value
+            BIKE_MATH_MUL_DIV64,        // A library call on Cortex-M4, only when 32 bits could overflow
+        } math_t;
+
+        // Decode frame into data. Returns true if the frame carried at least one known signal.
+        bool decode(const can_frame_t &frame, bike_data_t &data) const {
+            return dispatch(frame, data, std::make_index_sequence<_tables.num_messages>());
+        }
+
+        constexpr size_t numMessages() const {
+            return _tables.num_messages;
+        }
+
+        constexpr uint16_t messageId(size_t index) const {
+            return _tables.messages[index].id;
+        }
+
+        const message_t *findMessage(long unsigned int id) const {
+            uint8_t slot = (id < BIKE_CAN_STD_ID_COUNT) ? _tables.lookup[id] : 0;
+            return slot ? &_tables.messages[slot - 1] : nullptr;
+        }
+
+        constexpr const bike_can_signal_t &signal(size_t index) const {
+            return Signals[index];
+        }
+
+        static constexpr math_t math(size_t index) {
+            return mathFor(Signals[index]);
+        }
+
+    private:
+        struct tables_t {
+            message_t messages[N];
+            size_t num_messages;
+            uint8_t lookup[BIKE_CAN_STD_ID_COUNT];  // 1 + index into messages, 0 for unknown IDs
+        };
+
+        static constexpr tables_t buildTables() {
+            tables_t tables = {};
+            // Spelled out because GCC does not treat the value-initialized array as constant
+            for (size_t i = 0; i < N; i++) {
+                tables.messages[i] = { 0, 0, 0, 0 };
+            }
+            for (size_t i = 0; i < BIKE_CAN_STD_ID_COUNT; i++) {
+                tables.lookup[i] = 0;
+            }
+            tables.num_messages = 0;
+            for (size_t i = 0; i < N; i++) {
+                if (tables.num_messages == 0 || tables.messages[tables.num_messages - 1].id != Signals[i].id) {
+                    tables.messages[tables.num_messages] = { Signals[i].id, Signals[i].dlc, (uint8_t)i, 0 };
+                    tables.num_messages++;
+                    tables.lookup[Signals[i].id] = (uint8_t)tables.num_messages;
+                }
+                tables.messages[tables.num_messages - 1].num_signals++;
+            }
+            return tables;
+        }
+
+        static constexpr tables_t _tables = buildTables();
+
+        static constexpr uint8_t log2(int32_t value) {
+            uint8_t bits = 0;
+            while (value > 1) {
+                value >>= 1;
+                bits++;
+            }
+            return bits;
+        }
+
+        static constexpr math_t mathFor(const bike_can_signal_t &sig) {
+            if (sig.field_type == BIKE_FIELD_FLOAT || sig.div <= 0 || sig.mul < 0) {
+                return BIKE_MATH_MUL_DIV64;
+            }
+            if (sig.mul == 1 && sig.div == 1) {
+                return BIKE_MATH_ADD;
+            }
+            if (sig.mul == 1 && (sig.div & (sig.div - 1)) == 0) {
+                return BIKE_MATH_SHIFT;
+            }
+            uint64_t raw_max = (sig.length >= 4) ? UINT32_MAX : (1ULL << (8 * sig.length)) - 1;
+            return (raw_max * (uint64_t)sig.mul <= UINT32_MAX) ? BIKE_MATH_MUL_DIV32 : BIKE_MATH_MUL_DIV64;
+        }
+
+        // le and be are the 8 payload bytes read little and big endian
+        template <size_t I>
+        static inline void decodeSignal(uint64_t le, uint64_t be, long unsigned int rx_ms, bike_data_t &data) {
+            constexpr const bike_can_signal_t &sig = Signals[I];
+            constexpr unsigned shift = (sig.order == BIKE_SIG_BIG_ENDIAN) ? 64 - 8 * (sig.byte_offset + sig.length) : 8 * sig.byte_offset;
+            constexpr uint32_t mask = (sig.length >= 4) ? UINT32_MAX : (uint32_t)((1ULL << (8 * sig.length)) - 1);
+            constexpr math_t math = mathFor(sig);
+
+            uint32_t raw = (uint32_t)(((sig.order == BIKE_SIG_BIG_ENDIAN) ? be : le) >> shift) & mask;
+
+            // Integer forms wrap to the field width exactly like the 64-bit expression would
+            uint32_t scaled = 0;
+            if constexpr (math == BIKE_MATH_ADD) {
+                scaled = raw + (uint32_t)sig.offset;
+            } else if constexpr (math == BIKE_MATH_SHIFT) {
+                scaled = (raw >> log2(sig.div)) + (uint32_t)sig.offset;
+            } else if constexpr (math == BIKE_MATH_MUL_DIV32) {
+                scaled = raw * (uint32_t)sig.mul / (uint32_t)sig.div + (uint32_t)sig.offset;
+            } else if constexpr (sig.field_type != BIKE_FIELD_FLOAT) {
+                scaled = (uint32_t)((int64_t)raw * sig.mul / sig.div + sig.offset);
+            }
+
+            uint8_t *field = (uint8_t *)&data + sig.field_offset;
+            if constexpr (sig.field_type == BIKE_FIELD_U8) {
+                uint8_t value = (uint8_t)scaled;
+                memcpy(field, &value, sizeof(value));
+            } else if constexpr (sig.field_type == BIKE_FIELD_U32) {
+                memcpy(field, &scaled, sizeof(scaled));
+            } else {
+                float value = ((float)raw * (float)sig.mul) / (float)sig.div + (float)sig.offset;
+                memcpy(field, &value, sizeof(value));
+            }
+            data.updated_ms[sig.field] = rx_ms;
+        }
+
+        template <size_t First, size_t... K>
+        static inline void decodeSignals(uint64_t le, uint64_t be, long unsigned int rx_ms, bike_data_t &data, std::index_sequence<K...>) {
+            (decodeSignal<First + K>(le, be, rx_ms, data), ...);
+        }
+
+        template <size_t M>
+        static inline bool decodeMessage(const can_frame_t &frame, bike_data_t &data) {
+            constexpr message_t msg = _tables.messages[M];
+            if (frame.len != msg.dlc) {
+                return false;
+            }
+
+            // The whole payload in both byte orders; each signal is then a constant shift and mask
+            uint64_t le = 0;
+            memcpy(&le, frame.rxBuf, sizeof(le));
+            uint64_t be = __builtin_bswap64(le);
+            decodeSignals<msg.first_signal>(le, be, frame.rxTimeMs, data, std::make_index_sequence<msg.num_signals>());
+            return true;
+        }
+
+        // One comparison per message ID, which the compiler lowers the way it would a switch
+        template <size_t... M>
+        static inline bool dispatch(const can_frame_t &frame, bike_data_t &data, std::index_sequence<M...>) {
+            bool decoded = false;
+            ((frame.rxId == _tables.messages[M].id && (decoded = decodeMessage<M>(frame, data), true)) || ...);
+            return decoded;
+        }
+};
+
+constexpr bool bikeCANSignalsSorted(const bike_can_signal_t *signals, size_t count) {
+    for (size_t i = 1; i < count; i++) {
+        if (signals[i].id < signals[i - 1].id) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(bikeCANSignalsSorted(bosch_can_signals, sizeof(bosch_can_signals) / sizeof(bosch_can_signals[0])),
+    "bosch_can_signals must be sorted by ID");
@@ -0,0 +1,206 @@
+#include "Particle.h"
+#include "config_service.h"
+#include "bike_can_diag.h"
+
+BikeCANDiag *BikeCANDiag::_instance = nullptr;
+
+Logger bike_can_diag("app.bike_can.diag");
+
+#define UDS_NEGATIVE_RESPONSE           (0x7F)
+#define UDS_NRC_RESPONSE_PENDING        (0x78)
+
+#define BIKE_CAN_DIAG_CONFIG(name, n) \
+    ConfigObject(name, { \
+        ConfigBool("enable", &_config[n].enable), \
+        ConfigInt("tx", &_config[n].tx_id, 0, 0x7FF), \
+        ConfigInt("rx", &_config[n].rx_id, 0, 0x7FF), \
+        ConfigInt("req", &_config[n].request), \
+        ConfigInt("len", &_config[n].len, 1, BIKE_CAN_DIAG_MAX_REQUEST), \
+        ConfigInt("interval", &_config[n].interval_s, 10, 7*24*60*60), \
+    })
+
+void BikeCANDiag::setup() {
+    static_assert(BIKE_CAN_DIAG_MAX == 4, "can_diag config object expects 4 slots");
+
+    static ConfigObject canDiagDesc("can_diag", {
+            BIKE_CAN_DIAG_CONFIG("req1", 0),
+            BIKE_CAN_DIAG_CONFIG("req2", 1),
+            BIKE_CAN_DIAG_CONFIG("req3", 2),
+            BIKE_CAN_DIAG_CONFIG("req4", 3),
+        },
+        [](bool write, const void *context) { return 0; },
+        std::bind(&BikeCANDiag::exit_config_cb, this, _1, _2, _3)
+    );
+    ConfigService::instance().registerModule(canDiagDesc);
+}
+
+#undef BIKE_CAN_DIAG_CONFIG
+
+int BikeCANDiag::exit_config_cb(bool write, int status, const void *context) {
+    if (write && !status) {
+        // Run reconfigured slots on the next pass
+        for (size_t i = 0; i < BIKE_CAN_DIAG_MAX; i++) {
+            _slots[i].next_ms = 0;
+        }
+        _generation++;
+    }
+    return status;
+}
+
+int BikeCANDiag::registerDecoder(size_t slot, BikeCANDiagDecoder decoder) {
+    if (slot >= BIKE_CAN_DIAG_MAX) {
+        return SYSTEM_ERROR_INVALID_ARGUMENT;
+    }
+    _decoders[slot] = decoder;
+    return SYSTEM_ERROR_NONE;
+}
+
+bool BikeCANDiag::getResponse(size_t slot, uint8_t *data, size_t &len, long unsigned int *updated_ms) {
+    if (slot >= BIKE_CAN_DIAG_MAX || _slots[slot].updated_ms == 0) {
+        return false;
+    }
+    size_t n = (_slots[slot].response_len < len) ? _slots[slot].response_len : len;
+    memcpy(data, _slots[slot].response, n);
+    len = n;
+    if (updated_ms) {
+        *updated_ms = _slots[slot].updated_ms;
+    }
+    return true;
+}
+
+size_t BikeCANDiag::getIds(uint16_t *ids, size_t max_ids) {
+    size_t count = 0;
+    for (size_t i = 0; i < BIKE_CAN_DIAG_MAX && count < max_ids; i++) {
+        if (!_config[i].enable) {
+            continue;
+        }
+        bool seen = false;
+        for (size_t j = 0; j < count; j++) {
+            if (ids[j] == _config[i].rx_id) {
+                seen = true;
+                break;
+            }
+        }
+        if (!seen) {
+            ids[count++] = (uint16_t)_config[i].rx_id;
+        }
+    }
+    return count;
+}
+
+void BikeCANDiag::loop() {
+    _isotp.loop();
+
+    // Only ask while the bike is awake to answer
+    if (_current == BIKE_CAN_DIAG_MAX && BikeCANBus::instance().isActive()) {
+        startNext();
+    }
+
+    publishNext();
+}
+
+// Send the most overdue enabled slot, if any is due
+void BikeCANDiag::startNext() {
+    long unsigned int now = millis();
+    size_t next = BIKE_CAN_DIAG_MAX;
+    for (size_t i = 0; i < BIKE_CAN_DIAG_MAX; i++) {
+        if (!_config[i].enable || (long)(now - _slots[i].next_ms) < 0) {
+            continue;
+        }
+        if (next == BIKE_CAN_DIAG_MAX || (long)(_slots[i].next_ms - _slots[next].next_ms) < 0) {
+            next = i;
+        }
+    }
+    if (next == BIKE_CAN_DIAG_MAX) {
+        return;
+    }
+
+    const bike_can_diag_config_t &cfg = _config[next];
+    uint8_t request[BIKE_CAN_DIAG_MAX_REQUEST];
+    for (int32_t b = 0; b < cfg.len; b++) {
+        request[b] = (uint8_t)((uint32_t)cfg.request >> (8 * (cfg.len - 1 - b)));
+    }
+
+    // Due again a full interval from now whatever happens, so a silent ECU is not hammered
+    _slots[next].next_ms = now + (long unsigned int)cfg.interval_s * 1000;
+    _current = next;
+
+    int ret = _isotp.request(cfg.tx_id, cfg.rx_id, request, cfg.len, [this](bike_isotp_result_t result, const uint8_t *data, size_t len) {
+        response(result, data, len);
+    });
+    if (ret != SYSTEM_ERROR_NONE) {
+        bike_can_diag.warn("req%u not sent (%d)", next + 1, ret);
+        _slots[next].errors++;
+        _current = BIKE_CAN_DIAG_MAX;
+    }
+}
+
+void BikeCANDiag::response(bike_isotp_result_t result, const uint8_t *data, size_t len) {
+    size_t slot = _current;
+    if (slot >= BIKE_CAN_DIAG_MAX) {
+        return;
+    }
+
+    if (result == BIKE_ISOTP_OK && len >= 3 && data[0] == UDS_NEGATIVE_RESPONSE && data[2] == UDS_NRC_RESPONSE_PENDING) {
+        _isotp.awaitResponse(BIKE_CAN_DIAG_PENDING_MS);
+        return;
+    }
+    _current = BIKE_CAN_DIAG_MAX;
+
+    if (result != BIKE_ISOTP_OK) {
+        bike_can_diag.warn("req%u failed (%u)", slot + 1, result);
+        _slots[slot].errors++;
+        return;
+    }
+    if (len >= 1 && data[0] == UDS_NEGATIVE_RESPONSE) {
+        bike_can_diag.warn("req%u negative response (NRC 0x%02X)", slot + 1, (len >= 3) ? data[2] : 0);
+        _slots[slot].errors++;
+        return;
+    }
+
+    bike_can_diag_slot_t &s = _slots[slot];
+    s.ok++;
+    s.updated_ms = millis();
+    memcpy(s.response, data, len);
+    s.response_len = len;
+
+    if (_decoders[slot]) {
+        _decoders[slot](slot, data, len);
+    } else {
+        s.publish = true;
+    }
+}
+
+// Responses without a decoder go to the cloud as hex, one event at a time
+void BikeCANDiag::publishNext() {
+    if (!Particle.connected() || millis() - _last_publish_ms < BIKE_CAN_DIAG_PUBLISH_MS) {
+        return;
+    }
+
+    for (size_t i = 0; i < BIKE_CAN_DIAG_MAX; i++) {
+        bike_can_diag_slot_t &s = _slots[i];
+        if (!s.publish) {
+            continue;
+        }
+        s.publish = false;
+
+        char hex[BIKE_ISOTP_MAX_PAYLOAD * 2 + 1] = { 0 };
+        for (size_t b = 0; b < s.response_len; b++) {
+            snprintf(&hex[b * 2], 3, "%02x", s.response[b]);
+        }
+
+        char buf[sizeof(hex) + 64];
+        JSONBufferWriter writer(buf, sizeof(buf) - 1);
+        writer.beginObject();
+        writer.name("req").value((unsigned int)(i + 1));
+        writer.name("ok").value((unsigned int)s.ok);
+        writer.name("err").value((unsigned int)s.errors);
+        writer.name("d").value(hex);
+        writer.endObject();
+        buf[(writer.dataSize() < sizeof(buf) - 1) ? writer.dataSize() : sizeof(buf) - 1] = '\0';
+
+        Particle.publish("can_diag", buf);
+        _last_publish_ms = millis();
+        return;
+    }
+}
@@ -0,0 +1,99 @@
+// Scheduled diagnostic requests over ISO-TP, configured through the "can_diag" config module
+//
+// Each enabled slot sends a short request (typically a UDS service and data identifier) to a
+// request ID every interval and collects the reassembled response from a response ID. One
+// exchange is in flight at a time; the next due slot goes out as soon as the previous one
+// finishes, so nothing ever waits in loop(). Responses go to a decoder registered for the slot,
+// or are published as "can_diag" events when there is none.
+#pragma once
+
+#include <atomic>
+
+#include "Particle.h"
+#include "bike_canbus.h"
+#include "bike_isotp.h"
+
+#define BIKE_CAN_DIAG_MAX               (4)
+#define BIKE_CAN_DIAG_MAX_REQUEST       (4)         // Request bytes per slot, packed into one config int
+#define BIKE_CAN_DIAG_PENDING_MS        (5000)      // Extra wait after a UDS "response pending"
+#define BIKE_CAN_DIAG_PUBLISH_MS        (1000)      // Minimum gap between "can_diag" events
+
+typedef struct {
+    bool enable;
+    int32_t tx_id;                  // 11-bit request ID
+    int32_t rx_id;                  // 11-bit response ID
+    int32_t request;                // Request bytes, big endian, the last len bytes of the int
+    int32_t len;                    // 1 to BIKE_CAN_DIAG_MAX_REQUEST
+    int32_t interval_s;
+} bike_can_diag_config_t;
+
+typedef struct {
+    long unsigned int next_ms;      // When the slot is next due
+    long unsigned int updated_ms;   // Last good response, 0 if none
+    uint32_t ok;
+    uint32_t errors;                // Transport failures and negative responses
+    uint8_t response[BIKE_ISOTP_MAX_PAYLOAD];
+    size_t response_len;
+    bool publish;                   // Response waiting to be published
+} bike_can_diag_slot_t;
+
+// slot, and the response including the positive response service ID
+using BikeCANDiagDecoder = std::function<void(size_t slot, const uint8_t *data, size_t len)>;
+
+class BikeCANDiag {
+    public:
+        static BikeCANDiag &instance()
+        {
+            if(!_instance)
+            {
+                _instance = new BikeCANDiag();
+            }
+            return *_instance;
+        }
+
+        void setup();
+        void loop();
+
+        // Feed every received frame
+        inline bool processFrame(const can_frame_t &frame) {
+            return _isotp.processFrame(frame);
+        }
+
+        int registerDecoder(size_t slot, BikeCANDiagDecoder decoder);
+
+        // Last good response for a slot; false if there has not been one
+        bool getResponse(size_t slot, uint8_t *data, size_t &len, long unsigned int *updated_ms = nullptr);
+
+        // Response IDs of the enabled slots (deduplicated), so the acceptance filters can let them through
+        size_t getIds(uint16_t *ids, size_t max_ids);
+
+        // Incremented every time the slot configuration changes
+        inline uint32_t getGeneration() {
+            return _generation;
+        }
+
+    private:
+        BikeCANDiag() : _current(BIKE_CAN_DIAG_MAX), _generation(0), _last_publish_ms(0) {
+            memset(_config, 0, sizeof(_config));
+            memset(_slots, 0, sizeof(_slots));
+            for (size_t i = 0; i < BIKE_CAN_DIAG_MAX; i++) {
+                _config[i].len = 1;
+                _config[i].interval_s = 3600;
+            }
+        };
+
+        static BikeCANDiag *_instance;
+
+        bike_can_diag_config_t _config[BIKE_CAN_DIAG_MAX];
+        bike_can_diag_slot_t _slots[BIKE_CAN_DIAG_MAX];
+        BikeCANDiagDecoder _decoders[BIKE_CAN_DIAG_MAX];
+        BikeISOTP _isotp;
+        size_t _current;                // Slot in flight, BIKE_CAN_DIAG_MAX when idle
+        std::atomic<uint32_t> _generation;
+        long unsigned int _last_publish_ms;
+
+        int exit_config_cb(bool write, int status, const void *context);
+        void startNext();
+        void response(bike_isotp_result_t result, const uint8_t *data, size_t len);
+        void publishNext();
+};
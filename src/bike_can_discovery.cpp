@@ -0,0 +1,233 @@
+#include "Particle.h"
+#include "bike_can_discovery.h"
+
+#include <math.h>
+#include <new>
+
+BikeCANDiscovery *BikeCANDiscovery::_instance = nullptr;
+
+Logger bike_can_discovery("app.bike_can.discovery");
+
+// Pearson correlation from running sums, 0 when either side never moved
+static float correlation(uint32_t n, uint64_t sum_x, uint64_t sum_xx, uint64_t sum_y, uint64_t sum_yy, uint64_t sum_xy) {
+    if (n < 2) {
+        return 0.0f;
+    }
+    double cov = (double)n * (double)sum_xy - (double)sum_x * (double)sum_y;
+    double var_x = (double)n * (double)sum_xx - (double)sum_x * (double)sum_x;
+    double var_y = (double)n * (double)sum_yy - (double)sum_y * (double)sum_y;
+    if (var_x <= 0.0 || var_y <= 0.0) {
+        return 0.0f;
+    }
+    return (float)(cov / sqrt(var_x * var_y));
+}
+
+void BikeCANDiscovery::loop() {
+    if (!_publish_requested || !Particle.connected() || millis() - _last_publish_ms < BIKE_CAN_DISCOVERY_PUBLISH_MS) {
+        return;
+    }
+
+    // Skip IDs that have not been seen; stop once every entry went out
+    while (_publish_index < _num_ids && _ids[_publish_index].frames == 0) {
+        _publish_index++;
+    }
+    if (_publish_index >= _num_ids) {
+        _publish_requested = false;
+        bike_can_discovery.info("Published %u IDs (%lu evictions)", _num_ids, _evictions);
+        if (!_enabled) {
+            // The run is over and its results went out
+            freeTable();
+        }
+        return;
+    }
+
+    static char buf[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+    memset(buf, 0, sizeof(buf));
+    JSONBufferWriter writer(buf, sizeof(buf) - 1);
+    const bike_can_discovery_id_t &entry = _ids[_publish_index++];
+    writeJSON(writer, entry);
+    if (writer.dataSize() > writer.bufferSize()) {
+        bike_can_discovery.error("Discovery for 0x%03lX does not fit an event (%u bytes), skipped", entry.id, writer.dataSize());
+        return;
+    }
+
+    Particle.publish("can_disc", buf);
+    _last_publish_ms = millis();
+}
+
+bool BikeCANDiscovery::setEnabled(bool enabled) {
+    if (enabled == _enabled) {
+        return true;
+    }
+
+    if (enabled) {
+        if (_publish_requested) {
+            // The last run's export is still going out; a new run must not mix into it
+            bike_can_discovery.warn("New discovery run, %u of %u IDs of the last run not published", _num_ids - _publish_index, _num_ids);
+            _publish_requested = false;
+        }
+        if (!_ids) {
+            _ids = new (std::nothrow) bike_can_discovery_id_t[BIKE_CAN_DISCOVERY_MAX_IDS];
+            if (!_ids) {
+                bike_can_discovery.error("Unable to allocate the discovery table (%u bytes)", sizeof(bike_can_discovery_id_t) * BIKE_CAN_DISCOVERY_MAX_IDS);
+                return false;
+            }
+        }
+        // Entries are cleared as they are taken by findOrAdd()
+        _num_ids = 0;
+        _evictions = 0;
+    } else {
+        // Send what this run found; the table is freed once it went out
+        requestPublish();
+    }
+    _enabled = enabled;
+    bike_can_discovery.info("Discovery %s", enabled ? "enabled" : "disabled");
+    return true;
+}
+
+void BikeCANDiscovery::freeTable() {
+    delete[] _ids;
+    _ids = nullptr;
+    _num_ids = 0;
+    _evictions = 0;
+}
+
+void BikeCANDiscovery::reset() {
+    if (!_enabled) {
+        _publish_requested = false;
+        freeTable();
+        return;
+    }
+    _num_ids = 0;
+    _evictions = 0;
+}
+
+int BikeCANDiscovery::command(String arg) {
+    if (arg == "on") {
+        return setEnabled(true) ? 0 : -1;
+    } else if (arg == "off") {
+        setEnabled(false);
+    } else if (arg == "reset") {
+        reset();
+    } else {
+        requestPublish();
+    }
+    return 0;
+}
+
+bike_can_discovery_id_t *BikeCANDiscovery::findOrAdd(long unsigned int id, long unsigned int now_ms) {
+    for (size_t i = 0; i < _num_ids; i++) {
+        if (_ids[i].id == id) {
+            return &_ids[i];
+        }
+    }
+
+    bike_can_discovery_id_t *entry = nullptr;
+    if (_num_ids < BIKE_CAN_DISCOVERY_MAX_IDS) {
+        entry = &_ids[_num_ids++];
+    } else {
+        // Same policy as BikeCANStats: the ID that has gone the longest without a frame makes room
+        for (size_t i = 0; i < _num_ids; i++) {
+            if (!entry || (now_ms - _ids[i].last_seen_ms) > (now_ms - entry->last_seen_ms)) {
+                entry = &_ids[i];
+            }
+        }
+        _evictions++;
+    }
+
+    memset(entry, 0, sizeof(bike_can_discovery_id_t));
+    entry->id = id;
+    return entry;
+}
+
+void BikeCANDiscovery::recordFrame(const can_frame_t &frame, const bike_data_t &data) {
+    if (!_enabled) {
+        return;
+    }
+
+    bike_can_discovery_id_t *entry = findOrAdd(frame.rxId, frame.rxTimeMs);
+    uint8_t len = (frame.len <= 8) ? frame.len : 8;
+
+    // Only correlate against values that describe the bike as this frame was sent
+    long unsigned int speed_ms = data.updated_ms[BIKE_DATA_SPEED];
+    long unsigned int pas_ms = data.updated_ms[BIKE_DATA_PAS_LEVEL];
+    bool sample = speed_ms && pas_ms &&
+        frame.rxTimeMs - speed_ms <= BIKE_CAN_DISCOVERY_SIGNAL_AGE_MS && frame.rxTimeMs - pas_ms <= BIKE_CAN_DISCOVERY_SIGNAL_AGE_MS;
+    uint64_t s = (uint64_t)lroundf(data.speed * 100.0f);
+    uint64_t p = data.pas_level;
+    if (sample) {
+        entry->samples++;
+        entry->sum_s += s;
+        entry->sum_ss += s * s;
+        entry->sum_p += p;
+        entry->sum_pp += p * p;
+    }
+
+    for (uint8_t i = 0; i < len; i++) {
+        bike_can_discovery_byte_t &b = entry->bytes[i];
+        uint8_t x = frame.rxBuf[i];
+
+        if (entry->frames == 0 || i >= entry->len) {
+            b.min = b.max = x;
+        } else {
+            uint8_t diff = x ^ entry->last[i];
+            if (diff) {
+                b.changes++;
+                for (uint8_t bit = 0; bit < 8; bit++) {
+                    if ((diff & (1 << bit)) && b.flips[bit] < UINT16_MAX) {
+                        b.flips[bit]++;
+                    }
+                }
+            }
+            if (x < b.min) {
+                b.min = x;
+            }
+            if (x > b.max) {
+                b.max = x;
+            }
+        }
+
+        if (sample) {
+            b.sum_x += x;
+            b.sum_xx += (uint64_t)x * x;
+            b.sum_xs += x * s;
+            b.sum_xp += x * p;
+        }
+    }
+
+    memcpy(entry->last, frame.rxBuf, len);
+    entry->len = len;
+    entry->frames++;
+    entry->last_seen_ms = frame.rxTimeMs;
+}
+
+// {"id":209,"n":1234,"len":2,"k":800,"b":[[changes,min,max,r_speed,r_pas,[flips bit 0..7]],...]}
+// with the correlations scaled by 100
+void BikeCANDiscovery::writeJSON(JSONWriter &writer, const bike_can_discovery_id_t &entry) {
+    writer.beginObject();
+    writer.name("id").value((unsigned int)entry.id);
+    writer.name("n").value((unsigned int)entry.frames);
+    writer.name("len").value((unsigned int)entry.len);
+    writer.name("k").value((unsigned int)entry.samples);
+    writer.name("b").beginArray();
+    for (uint8_t i = 0; i < entry.len; i++) {
+        const bike_can_discovery_byte_t &b = entry.bytes[i];
+        float r_speed = correlation(entry.samples, b.sum_x, b.sum_xx, entry.sum_s, entry.sum_ss, b.sum_xs);
+        float r_pas = correlation(entry.samples, b.sum_x, b.sum_xx, entry.sum_p, entry.sum_pp, b.sum_xp);
+
+        writer.beginArray();
+        writer.value((unsigned int)b.changes);
+        writer.value((unsigned int)b.min);
+        writer.value((unsigned int)b.max);
+        writer.value((int)lroundf(r_speed * 100.0f));
+        writer.value((int)lroundf(r_pas * 100.0f));
+        writer.beginArray();
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            writer.value((unsigned int)b.flips[bit]);
+        }
+        writer.endArray();
+        writer.endArray();
+    }
+    writer.endArray();
+    writer.endObject();
+}
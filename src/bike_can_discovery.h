@@ -0,0 +1,105 @@
+// On-device statistics for finding undocumented CAN signals
+//
+// While enabled, every frame is folded into a fixed-size per-ID, per-byte table: how often the
+// byte changes, its range, how often each bit flips, and running sums for its correlation with the
+// decoded speed and assist level. Everything is integer adds per byte, so the cost per frame is
+// bounded; correlations are only worked out when the table is exported. The hardware filters are
+// opened while discovery runs so the MCU sees the whole bus.
+//
+// The table is allocated when discovery is turned on. Turning it off publishes the table and then
+// frees it, so none of it is held while discovery is not in use.
+#pragma once
+
+#include "Particle.h"
+#include "bike_canbus.h"
+
+#define BIKE_CAN_DISCOVERY_MAX_IDS          (16)
+#define BIKE_CAN_DISCOVERY_SIGNAL_AGE_MS    (500)   // Speed/PAS older than this are not correlated against
+#define BIKE_CAN_DISCOVERY_PUBLISH_MS       (1000)  // One "can_disc" event per ID, this far apart
+
+typedef struct {
+    uint32_t changes;               // Frames where the byte differed from the previous frame
+    uint8_t min;
+    uint8_t max;
+    uint16_t flips[8];              // Per bit, saturating
+    // Correlation sums over frames with fresh speed and PAS; speed is in 0.01 km/h
+    uint64_t sum_x;
+    uint64_t sum_xx;
+    uint64_t sum_xs;
+    uint64_t sum_xp;
+} bike_can_discovery_byte_t;
+
+typedef struct {
+    long unsigned int id;
+    uint32_t frames;
+    long unsigned int last_seen_ms;
+    uint8_t len;                    // Length of the last frame
+    uint8_t last[8];
+    uint32_t samples;               // Frames included in the correlation sums
+    uint64_t sum_s;
+    uint64_t sum_ss;
+    uint64_t sum_p;
+    uint64_t sum_pp;
+    bike_can_discovery_byte_t bytes[8];
+} bike_can_discovery_id_t;
+
+class BikeCANDiscovery {
+    public:
+        static BikeCANDiscovery &instance()
+        {
+            if(!_instance)
+            {
+                _instance = new BikeCANDiscovery();
+            }
+            return *_instance;
+        }
+
+        void loop();
+
+        // Called for every received frame with the decoder's current data
+        void recordFrame(const can_frame_t &frame, const bike_data_t &data);
+
+        // Returns false if the table could not be allocated
+        bool setEnabled(bool enabled);
+        inline bool isEnabled() {
+            return _enabled;
+        }
+
+        void reset();
+
+        // Publish one "can_disc" event per ID from loop()
+        inline void requestPublish() {
+            _publish_index = 0;
+            _publish_requested = true;
+        }
+
+        // Cloud function: "on", "off", "reset", anything else publishes the table
+        int command(String arg);
+
+    private:
+        BikeCANDiscovery() :
+            _enabled(false),
+            _ids(nullptr),
+            _num_ids(0),
+            _evictions(0),
+            _publish_requested(false),
+            _publish_index(0),
+            _last_publish_ms(0)
+        {
+        };
+
+        static BikeCANDiscovery *_instance;
+
+        bool _enabled;
+        bike_can_discovery_id_t *_ids;  // BIKE_CAN_DISCOVERY_MAX_IDS entries, only while enabled or not yet published
+        size_t _num_ids;
+        uint32_t _evictions;
+
+        bool _publish_requested;
+        size_t _publish_index;
+        long unsigned int _last_publish_ms;
+
+        void freeTable();
+        bike_can_discovery_id_t *findOrAdd(long unsigned int id, long unsigned int now_ms);
+        void writeJSON(JSONWriter &writer, const bike_can_discovery_id_t &entry);
+};
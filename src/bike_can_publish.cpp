@@ -0,0 +1,116 @@
+#include "Particle.h"
+#include "bike_can_publish.h"
+#include "bike_config.h"
+#include "bike_can_signals.h"
+#include "bike_can_stats.h"
+#include "bike_range.h"
+#include "tracker_location.h"
+
+BikeCANPublish *BikeCANPublish::_instance = nullptr;
+
+// A deadband of 0 sends the field on every publish
+bool BikeCANPublish::changed(const bike_data_t &snapshot, bike_data_field_t field) {
+    if (!(_published_mask & BIKE_DATA_FIELD_MASK(field))) {
+        return true;
+    }
+
+    BikeConfig &config = BikeConfig::instance();
+    switch (field) {
+        case BIKE_DATA_SPEED:
+            return fabsf(snapshot.speed - _published.speed) >= (float)config.getSpeedDeadband();
+        case BIKE_DATA_BATTERY_PCT:
+            return abs((int)snapshot.battery_pct - (int)_published.battery_pct) >= config.getBatteryDeadband();
+        case BIKE_DATA_ODOMETER:
+            return (int64_t)llabs((int64_t)snapshot.odometer - (int64_t)_published.odometer) >= config.getOdometerDeadband();
+        case BIKE_DATA_PAS_LEVEL:
+            return abs((int)snapshot.pas_level - (int)_published.pas_level) >= config.getPASDeadband();
+        default:
+            return true;
+    }
+}
+
+void BikeCANPublish::writeJSON(JSONWriter &writer, const bike_data_t &snapshot) {
+    // Leave out anything we have not heard from the bike recently rather than publish frozen values
+    uint32_t stale = BikeCANBus::getStaleFields(snapshot, millis());
+
+    int32_t keyframe_interval = BikeConfig::instance().getKeyframeInterval();
+    bool keyframe = _keyframe_requested || keyframe_interval <= 1 || _since_keyframe + 1 >= (uint32_t)keyframe_interval;
+    if (keyframe) {
+        _keyframe_requested = false;
+        _since_keyframe = 0;
+    } else {
+        _since_keyframe++;
+    }
+
+    // Deltas are always against what the backend acknowledged, never against a pending publish
+    _pending = _published;
+    _pending_mask = _published_mask;
+    _pending_keyframe = keyframe;
+
+    uint32_t unchanged = 0;
+    auto include = [&](bike_data_field_t field) {
+        if (BikeCANBus::isFieldStale(stale, field)) {
+            return false;
+        }
+        if (!keyframe && !changed(snapshot, field)) {
+            unchanged |= BIKE_DATA_FIELD_MASK(field);
+            return false;
+        }
+        _pending_mask |= BIKE_DATA_FIELD_MASK(field);
+        return true;
+    };
+
+    writer.name("can").beginObject();
+        if (include(BIKE_DATA_SPEED)) {
+            writer.name("sp").value(snapshot.speed, 2);
+            _pending.speed = snapshot.speed;
+        }
+        if (include(BIKE_DATA_BATTERY_PCT)) {
+            writer.name("bt").value(snapshot.battery_pct);
+            _pending.battery_pct = snapshot.battery_pct;
+            // Predicted range in km; it moves with the battery level, so it rides along with it
+            writer.name("rng").value(BikeRange::instance().getRangeKm(snapshot, stale), 1);
+        }
+        if (include(BIKE_DATA_ODOMETER)) {
+            writer.name("odo").value(snapshot.odometer);
+            _pending.odometer = snapshot.odometer;
+        }
+        if (include(BIKE_DATA_PAS_LEVEL)) {
+            writer.name("pas").value(snapshot.pas_level);
+            _pending.pas_level = snapshot.pas_level;
+        }
+        if (unchanged) {
+            writer.name("d").value((unsigned int)unchanged);
+        }
+        _pending_wakes = BikeCANBus::instance().getAvoidedWakes();
+        if (_pending_wakes) {
+            writer.name("aw").value((unsigned int)_pending_wakes);
+        }
+        BikeCANSignals::instance().writeJSON(writer);
+        if (BikeConfig::instance().getCANStatsPublishEnable()) {
+            BikeCANStats::instance().writeCompactJSON(writer);
+        }
+    writer.endObject();
+
+    uint32_t seq = ++_pending_seq;
+    TrackerLocation::instance().regLocPubCallback([this, seq](CloudServiceStatus status, const String &) {
+        return published(status, seq);
+    });
+}
+
+// Completion of the loc publish that carried pending seq
+int BikeCANPublish::published(CloudServiceStatus status, uint32_t seq) {
+    if (seq != _pending_seq) {
+        // A newer publish was built since; it carries everything this one did
+        return 0;
+    }
+    if (status == CloudServiceStatus::SUCCESS) {
+        _published = _pending;
+        _published_mask = _pending_mask;
+        BikeCANBus::instance().ackAvoidedWakes(_pending_wakes);
+    } else if (_pending_keyframe) {
+        _keyframe_requested = true;
+    }
+    _pending_wakes = 0;
+    return 0;
+}
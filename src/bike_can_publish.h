@@ -0,0 +1,68 @@
+// Builds the "can" object of the loc publish
+//
+// Fields are only sent when they moved past their deadband since the value the backend last
+// received. Fields left out for that reason are listed in a bitmask ("d", bits are
+// bike_data_field_t) so the backend can carry the previous value forward; a field that is neither
+// present nor in "d" is stale. Every few publishes a full keyframe is sent so the backend can
+// resynchronize after a lost event.
+//
+// What a publish sent is held as pending until the loc publish completes, and only becomes the
+// baseline for the deadbands once the cloud acknowledged it. A failed publish leaves the baseline
+// and the avoided wake count alone, so the next publish sends the same changes again.
+#pragma once
+
+#include "Particle.h"
+#include "bike_canbus.h"
+#include "cloud_service.h"
+
+class BikeCANPublish {
+    public:
+        static BikeCANPublish &instance()
+        {
+            if(!_instance)
+            {
+                _instance = new BikeCANPublish();
+            }
+            return *_instance;
+        }
+
+        // Write the "can" object for snapshot into a loc publish
+        void writeJSON(JSONWriter &writer, const bike_data_t &snapshot);
+
+        // Send every field on the next publish
+        inline void requestKeyframe() {
+            _keyframe_requested = true;
+        }
+
+    private:
+        BikeCANPublish() :
+            _published_mask(0),
+            _pending_mask(0),
+            _pending_wakes(0),
+            _pending_keyframe(false),
+            _pending_seq(0),
+            _since_keyframe(0),
+            _keyframe_requested(true)
+        {
+            memset(&_published, 0, sizeof(_published));
+            memset(&_pending, 0, sizeof(_pending));
+        };
+
+        static BikeCANPublish *_instance;
+
+        bike_data_t _published;         // Values the backend last received
+        uint32_t _published_mask;       // Fields in _published that were actually sent
+
+        // Written into the newest loc publish, not yet acknowledged
+        bike_data_t _pending;
+        uint32_t _pending_mask;
+        uint32_t _pending_wakes;
+        bool _pending_keyframe;
+        uint32_t _pending_seq;          // Bumped per publish so a late callback for an older one is ignored
+
+        uint32_t _since_keyframe;
+        bool _keyframe_requested;
+
+        bool changed(const bike_data_t &snapshot, bike_data_field_t field);
+        int published(CloudServiceStatus status, uint32_t seq);
+};
@@ -0,0 +1,58 @@
+// Lock-free single-producer/single-consumer ring buffer used to hand CAN frames
+// from the CAN receive thread to the application loop
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+template <typename T, size_t N>
+class BikeCANRing {
+    static_assert(N && ((N & (N - 1)) == 0), "BikeCANRing size must be a power of two");
+
+    public:
+        BikeCANRing() : _head(0), _tail(0) {};
+
+        // Producer side only. Returns false (and drops the item) if the ring is full.
+        bool push(const T &item) {
+            size_t head = _head.load(std::memory_order_relaxed);
+            if (head - _tail.load(std::memory_order_acquire) >= N) {
+                return false;
+            }
+            _buf[head & (N - 1)] = item;
+            _head.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer side only. Returns false if the ring is empty.
+        bool pop(T &item) {
+            size_t tail = _tail.load(std::memory_order_relaxed);
+            if (tail == _head.load(std::memory_order_acquire)) {
+                return false;
+            }
+            item = _buf[tail & (N - 1)];
+            _tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer side only. Throws away everything currently queued.
+        void clear() {
+            _tail.store(_head.load(std::memory_order_acquire), std::memory_order_release);
+        }
+
+        size_t size() const {
+            return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+        }
+
+        bool isEmpty() const {
+            return size() == 0;
+        }
+
+        static constexpr size_t capacity() {
+            return N;
+        }
+
+    private:
+        T _buf[N];
+        std::atomic<size_t> _head;
+        std::atomic<size_t> _tail;
+};
@@ -0,0 +1,183 @@
+#include "Particle.h"
+#include "config_service.h"
+#include "bike_can_signals.h"
+
+BikeCANSignals *BikeCANSignals::_instance = nullptr;
+
+Logger bike_can_signals("app.bike_can.signals");
+
+#define BIKE_CAN_SIGNAL_CONFIG(name, n) \
+    ConfigObject(name, { \
+        ConfigBool("enable", &_config[n].enable), \
+        ConfigInt("id", &_config[n].id, 0, 0x7FF), \
+        ConfigInt("start", &_config[n].start_bit, 0, 63), \
+        ConfigInt("len", &_config[n].length, 1, 32), \
+        ConfigBool("be", &_config[n].big_endian), \
+        ConfigFloat("scale", &_config[n].scale), \
+        ConfigFloat("offset", &_config[n].offset), \
+    })
+
+void BikeCANSignals::setup() {
+    static_assert(BIKE_CAN_SIGNALS_MAX == 8, "can_signals config object expects 8 slots");
+
+    static ConfigObject canSignalsDesc("can_signals", {
+            BIKE_CAN_SIGNAL_CONFIG("sig1", 0),
+            BIKE_CAN_SIGNAL_CONFIG("sig2", 1),
+            BIKE_CAN_SIGNAL_CONFIG("sig3", 2),
+            BIKE_CAN_SIGNAL_CONFIG("sig4", 3),
+            BIKE_CAN_SIGNAL_CONFIG("sig5", 4),
+            BIKE_CAN_SIGNAL_CONFIG("sig6", 5),
+            BIKE_CAN_SIGNAL_CONFIG("sig7", 6),
+            BIKE_CAN_SIGNAL_CONFIG("sig8", 7),
+        },
+        [](bool write, const void *context) { return 0; },
+        std::bind(&BikeCANSignals::exit_config_cb, this, _1, _2, _3)
+    );
+    ConfigService::instance().registerModule(canSignalsDesc);
+
+    // Build the plan from whatever was restored from flash
+    rebuildPlan();
+}
+
+#undef BIKE_CAN_SIGNAL_CONFIG
+
+int BikeCANSignals::exit_config_cb(bool write, int status, const void *context) {
+    if (write && !status) {
+        rebuildPlan();
+    }
+    return status;
+}
+
+// Compile the config slots into the inactive plan, then make it the active one
+void BikeCANSignals::rebuildPlan() {
+    uint8_t next = _active_plan ^ 1;
+    bike_can_plan_t &plan = _plans[next];
+
+    plan.count = 0;
+    for (size_t i = 0; i < BIKE_CAN_SIGNALS_MAX; i++) {
+        const bike_can_signal_config_t &cfg = _config[i];
+        if (!cfg.enable) {
+            continue;
+        }
+        if (cfg.start_bit + cfg.length > 64) {
+            bike_can_signals.warn("sig%u does not fit in a frame (start=%ld, len=%ld), ignoring", i + 1, cfg.start_bit, cfg.length);
+            continue;
+        }
+
+        // Insertion sort by ID keeps entries for the same frame together
+        size_t pos = plan.count;
+        while (pos > 0 && plan.entries[pos - 1].id > cfg.id) {
+            plan.entries[pos] = plan.entries[pos - 1];
+            pos--;
+        }
+        plan.entries[pos] = {
+            .id         = (uint16_t)cfg.id,
+            .start_bit  = (uint8_t)cfg.start_bit,
+            .length     = (uint8_t)cfg.length,
+            .big_endian = cfg.big_endian,
+            .slot       = (uint8_t)i,
+            .scale      = (float)cfg.scale,
+            .offset     = (float)cfg.offset
+        };
+        plan.count++;
+    }
+
+    _active_plan = next;
+    _generation++;
+
+    // Definitions may have changed meaning, so old values are no longer valid
+    memset(_valid, 0, sizeof(_valid));
+
+    bike_can_signals.info("Decode plan rebuilt: %u signal(s)", plan.count);
+}
+
+bool BikeCANSignals::processCANFrame(const can_frame_t &frame) {
+    const bike_can_plan_t &plan = _plans[_active_plan];
+    bool matched = false;
+
+    uint64_t le = 0, be = 0;
+    bool loaded = false;
+
+    for (uint8_t i = 0; i < plan.count; i++) {
+        const bike_can_plan_entry_t &entry = plan.entries[i];
+        if (entry.id < frame.rxId) {
+            continue;
+        }
+        if (entry.id > frame.rxId) {
+            break;
+        }
+        if (entry.start_bit + entry.length > frame.len * 8) {
+            continue;
+        }
+
+        if (!loaded) {
+            for (unsigned char b = 0; b < frame.len; b++) {
+                le |= (uint64_t)frame.rxBuf[b] << (8 * b);
+                be |= (uint64_t)frame.rxBuf[b] << (56 - 8 * b);
+            }
+            loaded = true;
+        }
+
+        uint64_t mask = (1ull << entry.length) - 1;
+        uint32_t raw;
+        if (entry.big_endian) {
+            raw = (uint32_t)((be >> (64 - entry.start_bit - entry.length)) & mask);
+        } else {
+            raw = (uint32_t)((le >> entry.start_bit) & mask);
+        }
+
+        _values[entry.slot]     = (float)raw * entry.scale + entry.offset;
+        _updated_ms[entry.slot] = frame.rxTimeMs;
+        _valid[entry.slot]      = true;
+        matched = true;
+    }
+
+    return matched;
+}
+
+bool BikeCANSignals::getValue(size_t slot, float &value, long unsigned int *updated_ms) {
+    if (slot >= BIKE_CAN_SIGNALS_MAX || !_valid[slot]) {
+        return false;
+    }
+    value = _values[slot];
+    if (updated_ms) {
+        *updated_ms = _updated_ms[slot];
+    }
+    return true;
+}
+
+size_t BikeCANSignals::getIds(uint16_t *ids, size_t max_ids) {
+    const bike_can_plan_t &plan = _plans[_active_plan];
+    size_t count = 0;
+
+    for (uint8_t i = 0; i < plan.count && count < max_ids; i++) {
+        // Plan is sorted by ID, so duplicates are adjacent
+        if (count == 0 || ids[count - 1] != plan.entries[i].id) {
+            ids[count++] = plan.entries[i].id;
+        }
+    }
+    return count;
+}
+
+void BikeCANSignals::writeJSON(JSONWriter &writer) {
+    bool any = false;
+    for (size_t i = 0; i < BIKE_CAN_SIGNALS_MAX; i++) {
+        if (_valid[i]) {
+            any = true;
+            break;
+        }
+    }
+    if (!any) {
+        return;
+    }
+
+    writer.name("sig").beginObject();
+    for (size_t i = 0; i < BIKE_CAN_SIGNALS_MAX; i++) {
+        if (_valid[i]) {
+            char name[8];
+            snprintf(name, sizeof(name), "sig%u", i + 1);
+            writer.name(name).value(_values[i], 3);
+        }
+    }
+    writer.endObject();
+}
@@ -0,0 +1,100 @@
+// Runtime CAN signal definitions, loaded from the "can_signals" config module
+//
+// Each configured signal slot is compiled into a compact decode plan sorted by CAN ID. Two plans
+// are kept so a new one can be built while the other is in use; switching is a single atomic
+// store, so reconfiguring never stops decoding. Decoded values land in a fixed store indexed by
+// slot number.
+#pragma once
+
+#include <atomic>
+
+#include "Particle.h"
+#include "bike_canbus.h"
+
+#define BIKE_CAN_SIGNALS_MAX            (8)
+
+typedef struct {
+    bool enable;
+    int32_t id;                     // 11-bit CAN ID
+    int32_t start_bit;              // See bike_can_plan_entry_t
+    int32_t length;                 // Signal length in bits, 1-32
+    bool big_endian;
+    double scale;
+    double offset;
+} bike_can_signal_config_t;
+
+// Little endian (Intel) signals: start_bit is the LSB, with bit n being bit (n % 8) of byte (n / 8).
+// Big endian (Motorola) signals: bits are numbered MSB first from the start of the frame
+// (bit 0 is the MSB of byte 0) and start_bit is the signal's MSB.
+typedef struct {
+    uint16_t id;
+    uint8_t start_bit;
+    uint8_t length;
+    bool big_endian;
+    uint8_t slot;                   // Index into the signal store
+    float scale;
+    float offset;
+} bike_can_plan_entry_t;
+
+typedef struct {
+    bike_can_plan_entry_t entries[BIKE_CAN_SIGNALS_MAX];
+    uint8_t count;
+} bike_can_plan_t;
+
+class BikeCANSignals {
+    public:
+        static BikeCANSignals &instance()
+        {
+            if(!_instance)
+            {
+                _instance = new BikeCANSignals();
+            }
+            return *_instance;
+        }
+
+        void setup();
+
+        // Decode any configured signals in frame. Returns true if the frame matched at least one.
+        bool processCANFrame(const can_frame_t &frame);
+
+        // Latest decoded value for a slot; false if the slot has not been decoded since boot/rebuild
+        bool getValue(size_t slot, float &value, long unsigned int *updated_ms = nullptr);
+
+        // CAN IDs used by the current plan (deduplicated), so the acceptance filters can let them through
+        size_t getIds(uint16_t *ids, size_t max_ids);
+
+        // Incremented every time the decode plan is rebuilt
+        inline uint32_t getGeneration() {
+            return _generation;
+        }
+
+        void writeJSON(JSONWriter &writer);
+
+    private:
+        BikeCANSignals() : _active_plan(0), _generation(0) {
+            memset(_config, 0, sizeof(_config));
+            memset(_plans, 0, sizeof(_plans));
+            memset(_values, 0, sizeof(_values));
+            memset(_updated_ms, 0, sizeof(_updated_ms));
+            memset(_valid, 0, sizeof(_valid));
+            for (size_t i = 0; i < BIKE_CAN_SIGNALS_MAX; i++) {
+                _config[i].length = 8;
+                _config[i].scale = 1.0;
+            }
+        };
+
+        static BikeCANSignals *_instance;
+
+        bike_can_signal_config_t _config[BIKE_CAN_SIGNALS_MAX];
+
+        bike_can_plan_t _plans[2];
+        std::atomic<uint8_t> _active_plan;
+        std::atomic<uint32_t> _generation;
+
+        float _values[BIKE_CAN_SIGNALS_MAX];
+        long unsigned int _updated_ms[BIKE_CAN_SIGNALS_MAX];
+        bool _valid[BIKE_CAN_SIGNALS_MAX];
+
+        int exit_config_cb(bool write, int status, const void *context);
+        void rebuildPlan();
+};
@@ -0,0 +1,251 @@
+#include "Particle.h"
+#include "bike_can_stats.h"
+#include "bike_config.h"
+
+BikeCANStats *BikeCANStats::_instance = nullptr;
+
+Logger bike_can_stats("app.bike_can.stats");
+
+static const uint16_t bike_can_stats_jitter_limits_ms[BIKE_CAN_STATS_JITTER_BUCKETS] = { 1, 2, 5, 10, 50, UINT16_MAX };
+
+// Nominal frame size on the wire: SOF, arbitration, control, CRC, ACK, EOF and intermission,
+// plus the data field. Stuff bits are not counted, which typically adds up to 10%.
+#define CAN_STD_FRAME_OVERHEAD_BITS     (47)
+#define CAN_EXT_FRAME_OVERHEAD_BITS     (67)
+#define CAN_ID_EXT_FLAG                 (0x80000000UL)
+
+static uint32_t frameBits(const can_frame_t &frame) {
+    uint32_t overhead = (frame.rxId & CAN_ID_EXT_FLAG) ? CAN_EXT_FRAME_OVERHEAD_BITS : CAN_STD_FRAME_OVERHEAD_BITS;
+    return overhead + 8 * frame.len;
+}
+
+void BikeCANStats::setup() {
+    reset();
+}
+
+void BikeCANStats::loop() {
+    updateLoad(millis());
+
+    if (!_publish_requested || !Particle.connected() || millis() - _last_publish_ms < BIKE_CAN_STATS_PUBLISH_MS) {
+        return;
+    }
+    if (_publish_page >= getPageCount()) {
+        _publish_requested = false;
+        return;
+    }
+
+    static char buf[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+    memset(buf, 0, sizeof(buf));
+    JSONBufferWriter writer(buf, sizeof(buf) - 1);
+    writer.beginObject();
+    writeJSON(writer, _publish_page);
+    writer.endObject();
+
+    // A cut-off buffer is not valid JSON; leave the page out rather than confuse the backend
+    if (writer.dataSize() > writer.bufferSize()) {
+        bike_can_stats.error("CAN stats page %u too large (%u bytes), not published", _publish_page, writer.dataSize());
+    } else {
+        Particle.publish("can_stats", buf);
+    }
+    _last_publish_ms = millis();
+    _publish_page++;
+}
+
+void BikeCANStats::reset() {
+    // Keep pinned IDs, forget everything they collected
+    size_t kept = 0;
+    for (size_t i = 0; i < _num_ids; i++) {
+        if (_ids[i].pinned) {
+            long unsigned int id = _ids[i].id;
+            memset(&_ids[kept], 0, sizeof(bike_can_id_stats_t));
+            _ids[kept].id = id;
+            _ids[kept].pinned = true;
+            _ids[kept].interval_min_ms = UINT32_MAX;
+            kept++;
+        }
+    }
+    _num_ids = kept;
+    _evictions = 0;
+
+    _window_start_ms = millis();
+    _window_bits = 0;
+    _load_pct = 0.0f;
+    _load_peak_pct = 0.0f;
+}
+
+void BikeCANStats::pinId(long unsigned int id) {
+    bike_can_id_stats_t *entry = findOrAdd(id, millis());
+    if (entry) {
+        entry->pinned = true;
+    }
+}
+
+bike_can_id_stats_t *BikeCANStats::findOrAdd(long unsigned int id, long unsigned int now_ms) {
+    for (size_t i = 0; i < _num_ids; i++) {
+        if (_ids[i].id == id) {
+            return &_ids[i];
+        }
+    }
+
+    bike_can_id_stats_t *entry = nullptr;
+    if (_num_ids < BIKE_CAN_STATS_MAX_IDS) {
+        entry = &_ids[_num_ids++];
+    } else {
+        // Evict the unpinned ID that has gone the longest without a frame
+        for (size_t i = 0; i < _num_ids; i++) {
+            if (!_ids[i].pinned && (!entry || (now_ms - _ids[i].last_seen_ms) > (now_ms - entry->last_seen_ms))) {
+                entry = &_ids[i];
+            }
+        }
+        if (!entry) {
+            return nullptr;
+        }
+        _evictions++;
+    }
+
+    memset(entry, 0, sizeof(bike_can_id_stats_t));
+    entry->id = id;
+    entry->interval_min_ms = UINT32_MAX;
+    return entry;
+}
+
+void BikeCANStats::recordFrame(const can_frame_t &frame) {
+    updateLoad(frame.rxTimeMs);
+    _window_bits += frameBits(frame);
+
+    bike_can_id_stats_t *entry = findOrAdd(frame.rxId, frame.rxTimeMs);
+    if (!entry) {
+        return;
+    }
+
+    if (entry->count == 0) {
+        entry->first_seen_ms = frame.rxTimeMs;
+    } else {
+        uint32_t interval = frame.rxTimeMs - entry->last_seen_ms;
+        if (interval < entry->interval_min_ms) {
+            entry->interval_min_ms = interval;
+        }
+        if (interval > entry->interval_max_ms) {
+            entry->interval_max_ms = interval;
+        }
+
+        // Running mean over the intervals seen so far (count - 1 of them before this one)
+        uint32_t n = entry->count;
+        entry->interval_mean_ms += ((float)interval - entry->interval_mean_ms) / (float)n;
+
+        if (n > 1) {
+            float deviation = fabsf((float)interval - entry->interval_mean_ms);
+            for (size_t b = 0; b < BIKE_CAN_STATS_JITTER_BUCKETS; b++) {
+                if (deviation < bike_can_stats_jitter_limits_ms[b] || b == BIKE_CAN_STATS_JITTER_BUCKETS - 1) {
+                    if (entry->jitter[b] < UINT16_MAX) {
+                        entry->jitter[b]++;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    entry->count++;
+    entry->last_seen_ms = frame.rxTimeMs;
+}
+
+void BikeCANStats::updateLoad(long unsigned int now_ms) {
+    long unsigned int elapsed = now_ms - _window_start_ms;
+    if ((long)elapsed < BIKE_CAN_STATS_LOAD_WINDOW_MS) {
+        return;
+    }
+
+    _load_pct = 100.0f * (float)_window_bits / ((float)BikeCANBus::instance().getBitrate() * (float)elapsed / 1000.0f);
+    if (_load_pct > _load_peak_pct) {
+        _load_peak_pct = _load_pct;
+    }
+    _window_bits = 0;
+    _window_start_ms = now_ms;
+}
+
+const bike_can_id_stats_t *BikeCANStats::getIdStats(size_t index) {
+    return (index < _num_ids) ? &_ids[index] : nullptr;
+}
+
+// {"pg":0,"of":3,"load":..} then {"pg":1,"of":3,"ids":[..]}, ...
+void BikeCANStats::writeJSON(JSONWriter &writer, size_t page) {
+    writer.name("pg").value((unsigned int)page);
+    writer.name("of").value((unsigned int)getPageCount());
+    if (page > 0) {
+        size_t first = (page - 1) * BIKE_CAN_STATS_IDS_PER_PAGE;
+        size_t last = first + BIKE_CAN_STATS_IDS_PER_PAGE;
+        writer.name("ids").beginArray();
+        for (size_t i = first; i < last && i < _num_ids; i++) {
+            const bike_can_id_stats_t &entry = _ids[i];
+            if (entry.count == 0) {
+                continue;
+            }
+            writer.beginObject();
+            writer.name("id").value((unsigned int)entry.id);
+            writer.name("n").value((unsigned int)entry.count);
+            writer.name("age").value((unsigned int)(millis() - entry.last_seen_ms));
+            if (entry.count > 1) {
+                writer.name("avg").value(entry.interval_mean_ms, 1);
+                writer.name("min").value((unsigned int)entry.interval_min_ms);
+                writer.name("max").value((unsigned int)entry.interval_max_ms);
+                writer.name("jit").beginArray();
+                for (size_t b = 0; b < BIKE_CAN_STATS_JITTER_BUCKETS; b++) {
+                    writer.value((unsigned int)entry.jitter[b]);
+                }
+                writer.endArray();
+            }
+            writer.endObject();
+        }
+        writer.endArray();
+        return;
+    }
+
+    writer.name("load").value(_load_pct, 1);
+    writer.name("peak").value(_load_peak_pct, 1);
+    // Hardware filters on: load and IDs only cover the frames let through
+    writer.name("flt").value(BikeCANBus::instance().isHwFilterEnabled());
+    writer.name("evict").value((unsigned int)_evictions);
+
+    bike_can_counters_t counters;
+    BikeCANBus::instance().getCounters(counters);
+    writer.name("wake").beginObject();
+        writer.name("lat").value((unsigned int)counters.wake_latency_ms);
+        writer.name("latched").value((unsigned int)counters.wake_latched_frames);
+    writer.endObject();
+
+    writer.name("err").beginObject();
+        writer.name("st").value((unsigned int)counters.error_state);
+        writer.name("tec").value((unsigned int)counters.tec);
+        writer.name("rec").value((unsigned int)counters.rec);
+        writer.name("boff").value((unsigned int)counters.bus_off_count);
+        writer.name("rst").value((unsigned int)counters.controller_resets);
+        writer.name("rec_ms").value((unsigned int)counters.last_recovery_ms);
+        writer.name("rec_max").value((unsigned int)counters.max_recovery_ms);
+    writer.endObject();
+
+    int32_t sniff_interval = BikeConfig::instance().getSniffIntervalMs();
+    if (sniff_interval > 0) {
+        writer.name("sniff").beginObject();
+            writer.name("n").value((unsigned int)BikeCANBus::instance().getSniffCount());
+            writer.name("hit").value((unsigned int)BikeCANBus::instance().getSniffHits());
+            writer.name("ua").value(BikeCANBus::instance().getSniffCurrentModelUA(sniff_interval), 1);
+        writer.endObject();
+    }
+    writer.name("nid").value((unsigned int)_num_ids);
+}
+
+void BikeCANStats::writeCompactJSON(JSONWriter &writer) {
+    uint32_t frames = 0;
+    for (size_t i = 0; i < _num_ids; i++) {
+        frames += _ids[i].count;
+    }
+
+    writer.name("cs").beginObject();
+        writer.name("ld").value(_load_pct, 1);
+        writer.name("pk").value(_load_peak_pct, 1);
+        writer.name("flt").value(BikeCANBus::instance().isHwFilterEnabled());
+        writer.name("n").value((unsigned int)frames);
+        writer.name("ids").value((unsigned int)_num_ids);
+    writer.endObject();
+}
@@ -0,0 +1,117 @@
+// Per-ID CAN bus statistics and bus load estimate
+//
+// All storage is fixed size: IDs we decode are pinned in the table, other IDs share the remaining
+// entries and the least recently seen one is evicted when a new ID shows up.
+//
+// Only frames that reach the MCU are counted. With the hardware acceptance filters on, that is
+// just the decoded IDs, so the load is post-filter and no unknown IDs show up; payloads say so
+// with "flt". The filters are opened while can_stats_loc is enabled.
+#pragma once
+
+#include "Particle.h"
+#include "bike_canbus.h"
+
+#define BIKE_CAN_STATS_MAX_IDS          (16)
+#define BIKE_CAN_STATS_JITTER_BUCKETS   (6)
+#define BIKE_CAN_STATS_LOAD_WINDOW_MS   (1000)
+#define BIKE_CAN_STATS_IDS_PER_PAGE     (6)     // A full entry is under 100 bytes, so a page always fits one event
+#define BIKE_CAN_STATS_PUBLISH_MS       (1000)  // Gap between "can_stats" pages
+
+typedef struct {
+    long unsigned int id;
+    bool pinned;                    // Decoded ID, never evicted
+    uint32_t count;
+    long unsigned int first_seen_ms;
+    long unsigned int last_seen_ms;
+    uint32_t interval_min_ms;
+    uint32_t interval_max_ms;
+    float interval_mean_ms;
+    // |interval - mean| histogram, bucket upper bounds in bike_can_stats_jitter_limits_ms
+    uint16_t jitter[BIKE_CAN_STATS_JITTER_BUCKETS];
+} bike_can_id_stats_t;
+
+class BikeCANStats {
+    public:
+        static BikeCANStats &instance()
+        {
+            if(!_instance)
+            {
+                _instance = new BikeCANStats();
+            }
+            return *_instance;
+        }
+
+        void setup();
+        void loop();
+
+        // Called for every received frame, in reception order
+        void recordFrame(const can_frame_t &frame);
+
+        // Pin an ID in the table so unknown traffic can never push it out
+        void pinId(long unsigned int id);
+
+        void reset();
+
+        // Bus load over the last full window and the peak since reset, percent of the bus bit rate
+        inline float getBusLoad() {
+            return _load_pct;
+        }
+        inline float getPeakBusLoad() {
+            return _load_peak_pct;
+        }
+
+        const bike_can_id_stats_t *getIdStats(size_t index);
+        inline size_t getIdCount() {
+            return _num_ids;
+        }
+        inline uint32_t getEvictions() {
+            return _evictions;
+        }
+
+        // Full statistics for the cloud function, split in pages: page 0 has the bus-wide figures,
+        // the next pages BIKE_CAN_STATS_IDS_PER_PAGE IDs each. Compact summary for the loc publish.
+        void writeJSON(JSONWriter &writer, size_t page);
+        void writeCompactJSON(JSONWriter &writer);
+
+        inline size_t getPageCount() {
+            return 1 + (_num_ids + BIKE_CAN_STATS_IDS_PER_PAGE - 1) / BIKE_CAN_STATS_IDS_PER_PAGE;
+        }
+
+        // Publish the full statistics from loop(), one "can_stats" event per page
+        inline void requestPublish() {
+            _publish_page = 0;
+            _publish_requested = true;
+        }
+
+    private:
+        BikeCANStats() :
+            _num_ids(0),
+            _evictions(0),
+            _window_start_ms(0),
+            _window_bits(0),
+            _load_pct(0.0f),
+            _load_peak_pct(0.0f),
+            _publish_requested(false),
+            _publish_page(0),
+            _last_publish_ms(0)
+        {
+        };
+
+        static BikeCANStats *_instance;
+
+        bike_can_id_stats_t _ids[BIKE_CAN_STATS_MAX_IDS];
+        size_t _num_ids;
+        uint32_t _evictions;
+
+        long unsigned int _window_start_ms;
+        uint32_t _window_bits;
+        float _load_pct;
+        float _load_peak_pct;
+
+        bool _publish_requested;
+        size_t _publish_page;
+        long unsigned int _last_publish_ms;
+
+        bike_can_id_stats_t *findOrAdd(long unsigned int id, long unsigned int now_ms);
+        void updateLoad(long unsigned int now_ms);
+};
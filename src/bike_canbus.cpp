@@ -1,30 +1,766 @@
 #include "Particle.h"
 #include "bike_canbus.h"
+
+#include <fcntl.h>
+#include <unistd.h>
 #include "tracker.h"
+#include "bike_config.h"
+#include "bike_can_decoder.h"
+#include "bike_can_signals.h"
+#include "bike_can_stats.h"
+#include "bike_can_discovery.h"
+#include "bike_can_diag.h"
+#include "bike_blog.h"
 
 BikeCANBus *BikeCANBus::_instance = nullptr;
 
 Logger mcp_log("app.mcp25625");
 Logger bike_can("app.bike_can");
-Logger bike_can_raw("app.bike_can.raw");
+
+// MCP25625 SPI instructions used by the fast receive path
+#define MCP_INSTR_READ_STATUS           (0xA0)
+#define MCP_INSTR_READ_RX0              (0x90)      // READ RX BUFFER starting at RXB0SIDH
+#define MCP_INSTR_READ_RX1              (0x94)      // READ RX BUFFER starting at RXB1SIDH
+#define MCP_RXB_HEADER_LEN              (5)         // SIDH, SIDL, EID8, EID0, DLC
+#define MCP_RXB_SIDL_IDE                (0x08)
+#define MCP_RXB_SIDL_SRR                (0x10)
+#define MCP_RXB_DLC_RTR                 (0x40)
+#define MCP_TXB_TXREQ                   (0x08)      // TXBnCTRL: transmit requested / in progress
+#define MCP_TXB_TXERR                   (0x10)      // TXBnCTRL: bus error while sending, the MCP keeps retrying
+#define MCP_SPI_SETTINGS                SPISettings(10*MHZ, MSBFIRST, SPI_MODE0)    // MCP25625 tops out at 10 MHz
+
+// MCP25625 acceptance mask and filter registers (SIDH of each SIDH/SIDL/EID8/EID0 group)
+#define MCP_NUM_MASKS                   (2)
+#define MCP_NUM_FILTERS                 (6)
+#define MCP_RXB0_NUM_FILTERS            (2)         // RXF0-1 use mask 0 and feed RXB0, RXF2-5 use mask 1 and feed RXB1
+#define CAN_STD_ID_MASK                 (0x7FFUL)
+static const uint8_t mcp_mask_regs[MCP_NUM_MASKS]       = { 0x20, 0x24 };
+static const uint8_t mcp_filter_regs[MCP_NUM_FILTERS]   = { 0x00, 0x04, 0x08, 0x10, 0x14, 0x18 };
+
+// Decoder for the signals in bosch_can_signals; its message IDs also program the acceptance filters
+static constexpr BikeCANDecoder<bosch_can_signals> bike_can_decoder;
+
+// Changes whenever the runtime signals or the diagnostic slots change the set of IDs to accept
+static uint32_t filterGeneration() {
+    return BikeCANSignals::instance().getGeneration() + BikeCANDiag::instance().getGeneration();
+}
+
+// Same flags MCP_CAN::readMsgBufID() puts in the upper bits of the ID
+#define CAN_ID_EXT_FLAG                 (0x80000000UL)
+#define CAN_ID_RTR_FLAG                 (0x40000000UL)
 
 void BikeCANBus::setup() {
+    // Keep statistics for the IDs we decode no matter how much other traffic is on the bus
+    for (size_t i = 0; i < bike_can_decoder.numMessages(); i++) {
+        BikeCANStats::instance().pinId(bike_can_decoder.messageId(i));
+        _activity.track(bike_can_decoder.messageId(i));
+    }
+
+    // Start at the rate found on an earlier boot. Without one, listen for the bike's rate once; if
+    // the bus is quiet the default is kept, and a wrong rate is caught later by the error supervisor.
+    if (!loadBitrate()) {
+        uint8_t speed = probeBitrate(BIKE_CAN_SPEED);
+        _can_speed = speed ? speed : BIKE_CAN_SPEED;
+        _can_speed_confirmed = (speed != 0);
+        saveBitrate();
+    }
+    mcp_log.info("Bit rate %lu kbit/s (%s)", getBitrate() / 1000, _can_speed_confirmed ? "detected" : "default");
+
     // Make sure the last parameter is MCP_20MHZ; this is dependent on the crystal
     // connected to the CAN chip and it's 20 MHz on the Tracker SoM.
-    _status = begin(MCP_RX_STDEXT, BIKE_CAN_SPEED, MCP_20MHZ);
+    _status = begin(MCP_RX_STDEXT, _can_speed, MCP_20MHZ);
     if(_status == CAN_OK) {        
         mcp_log.info("Init OK");
 
+        // Only let the frames we decode through to the MCU; begin() leaves us in config mode
+        _hw_filter_requested = BikeConfig::instance().getCANHwFilterEnable();
+        _hw_filter_enabled = programAcceptanceFilters(_hw_filter_requested);
+
         // Change to normal mode to allow messages to be transmitted. If you don't do this,
         // the CAN chip will be in loopback mode.
         setMode(MCP_MODE_NORMAL);
     }
     else {
         mcp_log.error("Init FAILED (%d)", _status);
+        return;
+    }
+
+    // Start the CAN receive thread, which is woken from the CAN_INT falling edge
+    if (!_rx_event_queue && os_queue_create(&_rx_event_queue, sizeof(uint8_t), 1, nullptr)) {
+        _rx_event_queue = nullptr;
+        bike_can.error("os_queue_create() failed");
+        return;
+    }
+
+    if (!_thread) {
+        if (os_thread_create(&_thread, "bike_can", BIKE_CAN_THREAD_PRIORITY, BikeCANBus::canThreadFunction, this, OS_THREAD_STACK_SIZE_DEFAULT)) {
+            _thread = nullptr;
+            bike_can.error("os_thread_create() failed");
+            return;
+        }
+        attachInterrupt(CAN_INT, &BikeCANBus::canInterruptHandler, this, FALLING);
+    }
+}
+
+void BikeCANBus::canInterruptHandler() {
+    uint8_t event = 0;
+    if (_rx_event_queue) {
+        os_queue_put(_rx_event_queue, &event, 0, nullptr);
+    }
+}
+
+void BikeCANBus::canThreadFunction(void *param) {
+    BikeCANBus *self = static_cast<BikeCANBus *>(param);
+    unsigned int wait_ms = BIKE_CAN_THREAD_POLL_MS;
+
+    while (true) {
+        // Wait for the interrupt (or a newly queued transmit), but time out and look at the INT line
+        // anyway: it is level based and stays low while frames are pending, so a missed edge must
+        // not stall reception
+        uint8_t event;
+        os_queue_take(self->_rx_event_queue, &event, wait_ms, nullptr);
+
+        wait_ms = BIKE_CAN_THREAD_POLL_MS;
+        if (!self->_rx_suspended) {
+            if (!digitalRead(CAN_INT)) {
+                self->drainReceiveBuffers();
+            }
+            self->superviseErrors();
+            if (self->_silent_resets >= BIKE_CAN_REPROBE_RESETS) {
+                self->reprobeBitrate();
+            }
+            wait_ms = self->serviceTransmit();
+        }
+    }
+}
+
+void BikeCANBus::drainReceiveBuffers() {
+    const std::lock_guard<RecursiveMutex> lock(_mcp_mutex);
+
+    if (readReceiveBuffers() == 0) {
+        // some other trigger for INT
+        BikeBinLog::instance().warn(BLOG_MCP_INT_EMPTY, mcp2515_readRegister(MCP_CANINTE), mcp2515_readRegister(MCP_CANINTF));
+    }
+
+    checkControllerErrors();
+}
+
+// Move whatever is in RX0/RX1 into _rx_ring, up to BIKE_CAN_RX_DRAIN_MAX frames. Caller holds _mcp_mutex.
+unsigned int BikeCANBus::readReceiveBuffers() {
+    unsigned int count = 0;
+    while (count < BIKE_CAN_RX_DRAIN_MAX) {
+        can_frame_t frame;
+#if BIKE_CAN_FAST_RX
+        // One status read tells us about both buffers; each buffer is then read (and its
+        // RXnIF flag cleared) in a single chip select burst
+        uint8_t pending = readStatusFast() & (MCP_RX0IF | MCP_RX1IF);
+        if (!pending) {
+            break;
+        }
+        if (pending & MCP_RX0IF) {
+            readRxBufferFast(0, frame);
+            queueFrame(frame);
+            count++;
+        }
+        if (pending & MCP_RX1IF) {
+            readRxBufferFast(1, frame);
+            queueFrame(frame);
+            count++;
+        }
+#else
+        _rx_spi_transactions++;
+        if (CAN_MSGAVAIL != checkReceive()) {
+            break;
+        }
+        readMsgBufID(&frame.rxId, &frame.len, frame.rxBuf);
+        queueFrame(frame);
+        count++;
+#endif // BIKE_CAN_FAST_RX
+    }
+    return count;
+}
+
+void BikeCANBus::queueFrame(can_frame_t &frame) {
+    frame.rxTimeMs = millis();
+    _last_can_frame_time_ms = frame.rxTimeMs;
+
+    _rx_frames++;
+    if (!_rx_ring.push(frame)) {
+        _rx_dropped++;
+    }
+}
+
+// Returns the READ STATUS byte; bits 0 and 1 are RX0IF and RX1IF, same as in CANINTF
+uint8_t BikeCANBus::readStatusFast() {
+    SPI1.beginTransaction(MCP_SPI_SETTINGS);
+    digitalWrite(CAN_CS, LOW);
+    SPI1.transfer(MCP_INSTR_READ_STATUS);
+    uint8_t status = SPI1.transfer(0x00);
+    digitalWrite(CAN_CS, HIGH);
+    SPI1.endTransaction();
+
+    _rx_spi_transactions++;
+    return status;
+}
+
+// Reads one RX buffer with READ RX BUFFER. The MCP clears the buffer's RXnIF flag when CS is released.
+void BikeCANBus::readRxBufferFast(uint8_t buffer, can_frame_t &frame) {
+    uint8_t header[MCP_RXB_HEADER_LEN];
+
+    SPI1.beginTransaction(MCP_SPI_SETTINGS);
+    digitalWrite(CAN_CS, LOW);
+    SPI1.transfer((buffer == 0) ? MCP_INSTR_READ_RX0 : MCP_INSTR_READ_RX1);
+    for (unsigned int i = 0; i < MCP_RXB_HEADER_LEN; i++) {
+        header[i] = SPI1.transfer(0x00);
+    }
+    frame.len = header[4] & 0x0F;
+    if (frame.len > 8) {
+        frame.len = 8;
+    }
+    // Only clock out as many data bytes as the frame carries
+    for (unsigned int i = 0; i < frame.len; i++) {
+        frame.rxBuf[i] = SPI1.transfer(0x00);
+    }
+    digitalWrite(CAN_CS, HIGH);
+    SPI1.endTransaction();
+
+    _rx_spi_transactions++;
+
+    frame.rxId = ((long unsigned int)header[0] << 3) | (header[1] >> 5);
+    if (header[1] & MCP_RXB_SIDL_IDE) {
+        frame.rxId = (frame.rxId << 18) | ((long unsigned int)(header[1] & 0x03) << 16) | ((long unsigned int)header[2] << 8) | header[3];
+        frame.rxId |= CAN_ID_EXT_FLAG;
+        if (header[4] & MCP_RXB_DLC_RTR) {
+            frame.rxId |= CAN_ID_RTR_FLAG;
+        }
+    } else if (header[1] & MCP_RXB_SIDL_SRR) {
+        frame.rxId |= CAN_ID_RTR_FLAG;
+    }
+}
+
+void BikeCANBus::checkControllerErrors() {
+    uint8_t error;
+    if (CAN_CTRLERROR == checkError(&error)) {
+        // Getting a RX buffer overflow error (0xC0) means a frame arrived while both RX buffers
+        // were still full, and the controller threw it away. Count it and clear the flags.
+        if ( (error & MCP_EFLG_ERRORMASK) & (MCP_EFLG_RX0OVR | MCP_EFLG_RX1OVR) ) {
+            _rx_overflows++;
+            BikeBinLog::instance().warn(BLOG_MCP_RX_OVERFLOW, (error & MCP_EFLG_RX0OVR) ? 1 : 0, (error & MCP_EFLG_RX1OVR) ? 1 : 0);
+            mcp2515_modifyRegister(MCP_EFLG, (MCP_EFLG_RX0OVR | MCP_EFLG_RX1OVR), 0x00);
+        }
+        // Error passive and bus-off are followed by superviseErrors()
+    }
+}
+
+static const char *errorStateToStr(bike_can_error_state_t state) {
+    switch (state) {
+        case BIKE_CAN_ERR_ACTIVE:   return "active";
+        case BIKE_CAN_ERR_WARNING:  return "warning";
+        case BIKE_CAN_ERR_PASSIVE:  return "passive";
+        case BIKE_CAN_ERR_BUS_OFF:  return "bus-off";
+        default:                    return "unknown";
+    }
+}
+
+// Follows TEC/REC and EFLG. The MCP leaves bus-off by itself after 128 x 11 recessive bits and
+// error passive ends once good frames bring the counters down, so normally this only watches. If
+// bus-off lasts, or the MCP sits error passive without receiving anything (typically a flaky
+// connector), the controller is reset and reinitialized, backing off exponentially between
+// attempts. Runs on the CAN thread so a reinit never holds up loop().
+void BikeCANBus::superviseErrors() {
+    long unsigned int now = millis();
+    if (now - _error_poll_ms < BIKE_CAN_ERROR_POLL_MS) {
+        return;
+    }
+    _error_poll_ms = now;
+
+    const std::lock_guard<RecursiveMutex> lock(_mcp_mutex);
+
+    uint8_t eflg = mcp2515_readRegister(MCP_EFLG);
+    _tec = errorCountTX();
+    _rec = errorCountRX();
+    _eflg = eflg;
+    _rx_spi_transactions += 3;
+
+    bike_can_error_state_t state = BIKE_CAN_ERR_ACTIVE;
+    if (eflg & MCP_EFLG_TXBO) {
+        state = BIKE_CAN_ERR_BUS_OFF;
+    } else if (eflg & (MCP_EFLG_TXEP | MCP_EFLG_RXEP)) {
+        state = BIKE_CAN_ERR_PASSIVE;
+    } else if (eflg & MCP_EFLG_EWARN) {
+        state = BIKE_CAN_ERR_WARNING;
+    }
+
+    if (state != _error_state) {
+        mcp_log.warn("Error state %s -> %s (TEC: %u, REC: %u, EFLG: 0x%02X)",
+            errorStateToStr(_error_state), errorStateToStr(state), (uint8_t)_tec, (uint8_t)_rec, eflg);
+        if (state == BIKE_CAN_ERR_BUS_OFF) {
+            _bus_off_count++;
+        }
+        _error_state = state;
+    }
+
+    // A fault is bus-off, or error passive with nothing received since it started
+    bool fault = (state == BIKE_CAN_ERR_BUS_OFF) ||
+        (state == BIKE_CAN_ERR_PASSIVE && (!_fault_start_ms || _rx_frames == _fault_rx_frames));
+
+    if (!fault) {
+        if (_fault_start_ms) {
+            if (state <= BIKE_CAN_ERR_WARNING) {
+                _last_recovery_ms = now - _fault_start_ms;
+                if (_last_recovery_ms > _max_recovery_ms) {
+                    _max_recovery_ms = (uint32_t)_last_recovery_ms;
+                }
+                mcp_log.info("Recovered after %lu ms", (uint32_t)_last_recovery_ms);
+            }
+            _fault_start_ms = 0;
+            _healthy_since_ms = now;
+            _silent_resets = 0;
+        } else if (now - _healthy_since_ms >= BIKE_CAN_RESET_BACKOFF_MAX_MS) {
+            // Only forget the backoff once the bus has stayed healthy, so a connector that keeps
+            // dropping out is not reset at the fastest rate forever
+            _reset_backoff_ms = BIKE_CAN_FAULT_RESET_MS;
+        }
+        return;
+    }
+
+    if (!_fault_start_ms) {
+        _fault_start_ms = now ? now : 1;
+        _fault_rx_frames = _rx_frames;
+        _next_reset_ms = now + _reset_backoff_ms;
+        return;
+    }
+
+    if ((long)(now - _next_reset_ms) >= 0) {
+        mcp_log.warn("Still %s after %lu ms, resetting controller", errorStateToStr(state), now - _fault_start_ms);
+        // Nothing at all received across resets is what the wrong bit rate looks like
+        _silent_resets = (_rx_frames == _fault_rx_frames) ? _silent_resets + 1 : 0;
+        resetController();
+
+        _reset_backoff_ms *= 2;
+        if (_reset_backoff_ms > BIKE_CAN_RESET_BACKOFF_MAX_MS) {
+            _reset_backoff_ms = BIKE_CAN_RESET_BACKOFF_MAX_MS;
+        }
+        _next_reset_ms = now + _reset_backoff_ms;
+        _fault_rx_frames = _rx_frames;
+    }
+}
+
+// Reset the MCP and bring it back up the way setup() does. Caller holds _mcp_mutex.
+bool BikeCANBus::resetController() {
+    _controller_resets++;
+
+    // Whatever was on TXB0 is gone
+    if (_tx_count && _tx_jobs[_tx_head].started_ms) {
+        _tx_errors++;
+        finishTransmit(BIKE_CAN_TX_ERROR);
+    }
+
+    _status = begin(MCP_RX_STDEXT, _can_speed, MCP_20MHZ);
+    if (_status != CAN_OK) {
+        mcp_log.error("Reinit FAILED (%d)", _status);
+        return false;
+    }
+    _hw_filter_enabled = programAcceptanceFilters(_hw_filter_requested);
+    setMode(MCP_MODE_NORMAL);
+    return true;
+}
+
+uint32_t BikeCANBus::bitrateForSpeed(uint8_t speed) {
+    switch (speed) {
+        case CAN_125KBPS:   return 125000;
+        case CAN_250KBPS:   return 250000;
+        case CAN_500KBPS:   return 500000;
+        case CAN_1000KBPS:  return 1000000;
+        default:            return BIKE_CAN_BITRATE;
+    }
+}
+
+// Listen at each common rate, first the one given, and return the first that receives frames
+// without errors, or 0 if none does. Listen only, so a wrong guess never disturbs the bus. Leaves
+// the MCP in listen only mode; the caller reinitializes it at the chosen rate.
+uint8_t BikeCANBus::probeBitrate(uint8_t first) {
+    const uint8_t candidates[] = { first, CAN_500KBPS, CAN_250KBPS, CAN_125KBPS, CAN_1000KBPS };
+
+    _probing = true;
+    uint8_t found = 0;
+    for (size_t i = 0; i < sizeof(candidates) && !found; i++) {
+        uint8_t speed = candidates[i];
+        if (i > 0 && speed == first) {
+            continue;
+        }
+
+        {
+            const std::lock_guard<RecursiveMutex> lock(_mcp_mutex);
+            if (begin(MCP_RX_STDEXT, speed, MCP_20MHZ) != CAN_OK) {
+                continue;
+            }
+            setMode(MCP_MODE_LISTENONLY);
+            mcp2515_setRegister(MCP_CANINTF, 0x00);
+        }
+
+        // RX0IF/RX1IF count good frames, MERRF is set by any frame with an error
+        unsigned int frames = 0;
+        bool errors = false;
+        long unsigned int start = millis();
+        while (millis() - start < BIKE_CAN_PROBE_WINDOW_MS && frames < BIKE_CAN_PROBE_MIN_FRAMES && !errors) {
+            delay(BIKE_CAN_THREAD_POLL_MS);
+
+            const std::lock_guard<RecursiveMutex> lock(_mcp_mutex);
+            uint8_t intf = mcp2515_readRegister(MCP_CANINTF);
+            errors = (intf & MCP_MERRF) != 0;
+            frames += ((intf & MCP_RX0IF) ? 1 : 0) + ((intf & MCP_RX1IF) ? 1 : 0);
+            mcp2515_modifyRegister(MCP_CANINTF, intf & (MCP_RX0IF | MCP_RX1IF | MCP_MERRF), 0x00);
+        }
+
+        mcp_log.info("Probe %lu kbit/s: %u frame(s)%s", bitrateForSpeed(speed) / 1000, frames, errors ? ", errors" : "");
+        if (frames >= BIKE_CAN_PROBE_MIN_FRAMES && !errors) {
+            found = speed;
+        }
+    }
+    _probing = false;
+    return found;
+}
+
+// Resets keep bringing nothing in: the bike may be on another rate. Runs on the CAN thread.
+void BikeCANBus::reprobeBitrate() {
+    _silent_resets = 0;
+
+    uint8_t speed = probeBitrate(_can_speed);
+    if (speed && (speed != _can_speed || !_can_speed_confirmed)) {
+        mcp_log.info("Bit rate %lu -> %lu kbit/s", getBitrate() / 1000, bitrateForSpeed(speed) / 1000);
+        _can_speed = speed;
+        _can_speed_confirmed = true;
+        saveBitrate();
+    }
+
+    const std::lock_guard<RecursiveMutex> lock(_mcp_mutex);
+    resetController();
+}
+
+typedef struct {
+    uint32_t magic;
+    uint8_t speed;
+    uint8_t confirmed;
+} bike_can_rate_file_t;
+
+#define BIKE_CAN_RATE_MAGIC             (0x42435231)    // "BCR1"
+
+bool BikeCANBus::loadBitrate() {
+    int fd = open(BIKE_CAN_RATE_FILE, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bike_can_rate_file_t cache;
+    bool ok = (read(fd, &cache, sizeof(cache)) == sizeof(cache)) && cache.magic == BIKE_CAN_RATE_MAGIC;
+    close(fd);
+
+    switch (ok ? cache.speed : 0) {
+        case CAN_125KBPS:
+        case CAN_250KBPS:
+        case CAN_500KBPS:
+        case CAN_1000KBPS:
+            _can_speed = cache.speed;
+            _can_speed_confirmed = cache.confirmed;
+            return true;
+        default:
+            return false;
+    }
+}
+
+void BikeCANBus::saveBitrate() {
+    bike_can_rate_file_t cache = { BIKE_CAN_RATE_MAGIC, _can_speed, _can_speed_confirmed };
+    int fd = open(BIKE_CAN_RATE_FILE, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0 || write(fd, &cache, sizeof(cache)) != sizeof(cache)) {
+        mcp_log.error("Unable to save bit rate to %s", BIKE_CAN_RATE_FILE);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Moves the head transmit job along: checks whether the MCP finished the frame on TXB0, loads the
+// next repeat or job when it is due, and gives up on frames that take too long. Only TXB0 is used
+// so frames go out in the order they were queued. Returns how long the CAN thread may wait before
+// calling again.
+unsigned int BikeCANBus::serviceTransmit() {
+    const std::lock_guard<RecursiveMutex> lock(_mcp_mutex);
+
+    if (_tx_count == 0) {
+        return BIKE_CAN_THREAD_POLL_MS;
+    }
+
+    bike_can_tx_job_t &job = _tx_jobs[_tx_head];
+    long unsigned int now = millis();
+
+    if (job.started_ms) {
+        // TX0IF is set when the frame made it onto the bus, whether or not its interrupt is enabled
+        if (mcp2515_readRegister(MCP_CANINTF) & MCP_TX0IF) {
+            mcp2515_modifyRegister(MCP_CANINTF, MCP_TX0IF, 0x00);
+            _tx_frames++;
+
+            job.sent++;
+            job.repeat--;
+            job.started_ms = 0;
+            job.tx_error = false;
+            if (job.repeat == 0) {
+                finishTransmit(BIKE_CAN_TX_OK);
+                return 1;
+            }
+            job.next_send_ms = now + job.spacing_ms;
+        } else {
+            if (mcp2515_readRegister(MCP_TXB0CTRL) & MCP_TXB_TXERR) {
+                job.tx_error = true;
+            }
+            if (now - job.started_ms >= BIKE_CAN_TX_TIMEOUT_MS) {
+                // Pull the frame back out of TXB0 so it does not go out later on its own
+                mcp2515_modifyRegister(MCP_TXB0CTRL, MCP_TXB_TXREQ, 0x00);
+                _tx_errors++;
+                finishTransmit(job.tx_error ? BIKE_CAN_TX_ERROR : BIKE_CAN_TX_TIMEOUT);
+            }
+            return 1;
+        }
+    }
+
+    if ((long)(job.next_send_ms - now) > 0) {
+        long unsigned int wait = job.next_send_ms - now;
+        return (wait < BIKE_CAN_THREAD_POLL_MS) ? (unsigned int)wait : BIKE_CAN_THREAD_POLL_MS;
+    }
+
+    uint8_t ext = (job.id & CAN_ID_EXT_FLAG) ? 1 : 0;
+    if (CAN_OK != trySendMsgBuf(job.id & ~CAN_ID_EXT_FLAG, ext, 0, job.len, job.buf, 0)) {
+        // TXB0 is still busy: everything goes through this queue, so the MCP is in a bad state
+        _tx_errors++;
+        finishTransmit(BIKE_CAN_TX_ERROR);
+        return 1;
+    }
+    job.started_ms = now ? now : 1;
+    return 1;
+}
+
+// Move the head job to _tx_done with its result. Caller holds _mcp_mutex.
+void BikeCANBus::finishTransmit(bike_can_tx_result_t result) {
+    bike_can_tx_job_t &job = _tx_jobs[_tx_head];
+    job.result = result;
+    _tx_done[_tx_done_count++] = job;
+    job.callback = nullptr;
+
+    _tx_head = (_tx_head + 1) % BIKE_CAN_TX_QUEUE_SIZE;
+    _tx_count--;
+}
+
+void BikeCANBus::dispatchTransmitCallbacks() {
+    bike_can_tx_job_t done[BIKE_CAN_TX_QUEUE_SIZE];
+    size_t count;
+    {
+        const std::lock_guard<RecursiveMutex> lock(_mcp_mutex);
+        count = _tx_done_count;
+        for (size_t i = 0; i < count; i++) {
+            done[i] = _tx_done[i];
+            _tx_done[i].callback = nullptr;
+        }
+        _tx_done_count = 0;
+    }
+
+    // Callbacks run without the lock so they can queue more frames
+    for (size_t i = 0; i < count; i++) {
+        const bike_can_tx_job_t &job = done[i];
+        if (job.result == BIKE_CAN_TX_OK) {
+            BikeBinLog::instance().info(BLOG_CAN_TX_OK, job.id, job.sent);
+        } else {
+            BikeBinLog::instance().error(BLOG_CAN_TX_FAIL, job.id, job.result, job.sent);
+        }
+        if (job.callback) {
+            job.callback(job.id, job.result, job.sent);
+        }
+    }
+}
+
+int BikeCANBus::queueTransmit(long unsigned int id, uint8_t len, const uint8_t *buf, uint8_t repeat, uint16_t spacing_ms,
+    BikeCANTxCallback callback) {
+    if (_status != CAN_OK) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    if (len > 8 || repeat == 0) {
+        return SYSTEM_ERROR_INVALID_ARGUMENT;
+    }
+
+    {
+        const std::lock_guard<RecursiveMutex> lock(_mcp_mutex);
+
+        // Jobs waiting for their callback still hold a slot
+        if (_tx_count + _tx_done_count >= BIKE_CAN_TX_QUEUE_SIZE) {
+            bike_can.error("TX queue full, dropping 0x%03lX", id);
+            return SYSTEM_ERROR_LIMIT_EXCEEDED;
+        }
+
+        bike_can_tx_job_t &job = _tx_jobs[(_tx_head + _tx_count) % BIKE_CAN_TX_QUEUE_SIZE];
+        job.id = id;
+        job.len = len;
+        memcpy(job.buf, buf, len);
+        job.repeat = repeat;
+        job.sent = 0;
+        job.spacing_ms = spacing_ms;
+        job.next_send_ms = millis();
+        job.started_ms = 0;
+        job.tx_error = false;
+        job.result = BIKE_CAN_TX_OK;
+        job.callback = callback;
+        _tx_count++;
+    }
+
+    // Have the CAN thread pick it up now rather than at its next poll
+    uint8_t event = 0;
+    if (_rx_event_queue) {
+        os_queue_put(_rx_event_queue, &event, 0, nullptr);
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+void BikeCANBus::getCounters(bike_can_counters_t &counters) {
+    counters.rx_frames           = _rx_frames;
+    counters.rx_dropped          = _rx_dropped;
+    counters.rx_overflows        = _rx_overflows;
+    counters.rx_spi_transactions = _rx_spi_transactions;
+    counters.rx_unhandled        = _rx_unhandled;
+    counters.tx_frames           = _tx_frames;
+    counters.tx_errors           = _tx_errors;
+    counters.wake_latched_frames = _wake_latched_frames;
+    counters.wake_latency_ms     = _wake_latency_ms;
+    counters.tec                 = _tec;
+    counters.rec                 = _rec;
+    counters.eflg                = _eflg;
+    counters.error_state         = _error_state;
+    counters.bus_off_count       = _bus_off_count;
+    counters.controller_resets   = _controller_resets;
+    counters.last_recovery_ms    = _last_recovery_ms;
+    counters.max_recovery_ms     = _max_recovery_ms;
+}
+
+int BikeCANBus::setHwFilterEnable(bool enable) {
+    const std::lock_guard<RecursiveMutex> lock(_mcp_mutex);
+
+    if (CAN_OK != setMode(MCP_MODE_CONFIG)) {
+        mcp_log.error("Unable to enter config mode to program filters");
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    _hw_filter_enabled = programAcceptanceFilters(enable);
+    setMode(MCP_MODE_NORMAL);
+
+    return (enable == _hw_filter_enabled) ? SYSTEM_ERROR_NONE : SYSTEM_ERROR_NOT_SUPPORTED;
+}
+
+// Program the 2 masks and 6 filters so that only the IDs we decode (the compiled decoder's messages
+// plus any runtime signals) and diagnostic responses are accepted. The MCP must be in config mode. Returns true if exact
+// filters were programmed, false if the controller was left accepting everything (filtering
+// disabled, or the ID set does not fit the filters).
+bool BikeCANBus::programAcceptanceFilters(bool enable) {
+    // Collect one more ID than we have filters so we can tell when the set does not fit
+    uint16_t ids[MCP_NUM_FILTERS + 1];
+    size_t num_ids = 0;
+    for (size_t i = 0; i < bike_can_decoder.numMessages() && num_ids < MCP_NUM_FILTERS + 1; i++) {
+        ids[num_ids++] = bike_can_decoder.messageId(i);
+    }
+
+    uint16_t runtime_ids[BIKE_CAN_SIGNALS_MAX];
+    size_t num_runtime_ids = BikeCANSignals::instance().getIds(runtime_ids, BIKE_CAN_SIGNALS_MAX);
+    for (size_t i = 0; i < num_runtime_ids && num_ids < MCP_NUM_FILTERS + 1; i++) {
+        if (!bike_can_decoder.findMessage(runtime_ids[i])) {
+            ids[num_ids++] = runtime_ids[i];
+        }
+    }
+
+    // Diagnostic responses
+    uint16_t diag_ids[BIKE_CAN_DIAG_MAX];
+    size_t num_diag_ids = BikeCANDiag::instance().getIds(diag_ids, BIKE_CAN_DIAG_MAX);
+    for (size_t i = 0; i < num_diag_ids && num_ids < MCP_NUM_FILTERS + 1; i++) {
+        bool seen = false;
+        for (size_t j = 0; j < num_ids; j++) {
+            seen = seen || (ids[j] == diag_ids[i]);
+        }
+        if (!seen) {
+            ids[num_ids++] = diag_ids[i];
+        }
+    }
+    _hw_filter_generation = filterGeneration();
+
+    // All decoded IDs are 11-bit, so the set fits as long as there are enough filters
+    bool fits = (num_ids > 0) && (num_ids <= MCP_NUM_FILTERS);
+    if (enable && !fits) {
+        mcp_log.warn("Decoded IDs do not fit the acceptance filters, accepting all frames");
+    }
+    enable = enable && fits;
+
+    writeAcceptanceFilters(ids, enable ? num_ids : 0);
+
+    mcp_log.info("Acceptance filters %s (%u IDs)", enable ? "enabled" : "disabled", num_ids);
+    return enable;
+}
+
+// Only accept the messages that carry speed or assist level, so the rest of a parked bike's traffic
+// does not end a sniff. The MCP must be in config mode.
+void BikeCANBus::programSniffFilters() {
+    uint16_t ids[MCP_NUM_FILTERS];
+    size_t num_ids = 0;
+    for (size_t i = 0; i < bike_can_decoder.numMessages() && num_ids < MCP_NUM_FILTERS; i++) {
+        const auto *msg = bike_can_decoder.findMessage(bike_can_decoder.messageId(i));
+        for (uint8_t s = 0; s < msg->num_signals; s++) {
+            bike_data_field_t field = bike_can_decoder.signal(msg->first_signal + s).field;
+            if (field == BIKE_DATA_SPEED || field == BIKE_DATA_PAS_LEVEL) {
+                ids[num_ids++] = msg->id;
+                break;
+            }
+        }
+    }
+    writeAcceptanceFilters(ids, num_ids);
+}
+
+// Program the masks and filters for exactly the IDs given, or to accept everything if num_ids is 0.
+// num_ids must not exceed MCP_NUM_FILTERS.
+void BikeCANBus::writeAcceptanceFilters(const uint16_t *ids, size_t num_ids) {
+    bool enable = (num_ids > 0);
+
+    // A zero mask passes everything. Otherwise each mask compares the full 11-bit ID, and the
+    // EID bits stay clear so the first two data bytes of standard frames are not filtered on.
+    long unsigned int mask = enable ? CAN_STD_ID_MASK : 0;
+    for (size_t m = 0; m < MCP_NUM_MASKS; m++) {
+        mcp2515_setRegister(mcp_mask_regs[m] + 0, (uint8_t)(mask >> 3));
+        mcp2515_setRegister(mcp_mask_regs[m] + 1, (uint8_t)((mask & 0x07) << 5));
+        mcp2515_setRegister(mcp_mask_regs[m] + 2, 0x00);
+        mcp2515_setRegister(mcp_mask_regs[m] + 3, 0x00);
+    }
+
+    // The first MCP_RXB0_NUM_FILTERS IDs go to RXB0 and the rest to RXB1. Unused filters repeat
+    // the last ID, so they never open up the filter to anything else.
+    for (size_t f = 0; f < MCP_NUM_FILTERS; f++) {
+        long unsigned int id = 0;
+        if (enable) {
+            id = ids[(f < num_ids) ? f : (num_ids - 1)];
+        }
+        mcp2515_setRegister(mcp_filter_regs[f] + 0, (uint8_t)(id >> 3));
+        mcp2515_setRegister(mcp_filter_regs[f] + 1, (uint8_t)((id & 0x07) << 5));   // EXIDE clear: standard frames only
+        mcp2515_setRegister(mcp_filter_regs[f] + 2, 0x00);
+        mcp2515_setRegister(mcp_filter_regs[f] + 3, 0x00);
     }
 }
 
 void BikeCANBus::sleepPrepareCallback() {
+    const std::lock_guard<RecursiveMutex> lock(_mcp_mutex);
+
+    // Keep the CAN thread away from the MCP until wakeup(); from here on INT is only used to wake us
+    _rx_suspended = true;
+    _wake_latency_pending = false;
+    _triage_state = BIKE_CAN_TRIAGE_NONE;   // Only the wake that started it is triaged
+
+    // Anything still queued would go out at some random point after we wake, so fail it now
+    if (_tx_count) {
+        mcp2515_modifyRegister(MCP_TXB0CTRL, MCP_TXB_TXREQ, 0x00);
+        while (_tx_count) {
+            _tx_errors++;
+            finishTransmit(BIKE_CAN_TX_TIMEOUT);
+        }
+    }
+
     // Clear all interrupts and disable RX buffer interrupts
     // We enable the wake interrupt later on in the sleep code, and this allows us to guarantee any interrupt received is for CAN activity
     mcp2515_setRegister(MCP_CANINTE, 0x00);     // Clear all interrupt enables so INT stays HIGH
@@ -32,7 +768,15 @@ void BikeCANBus::sleepPrepareCallback() {
 }
 
 // TODO: Verify power consumption in sleep to see if this actually works or not
-void BikeCANBus::sleepCallback() {
+void BikeCANBus::sleepCallback(bool sniff) {
+    const std::lock_guard<RecursiveMutex> lock(_mcp_mutex);
+
+    // Sniffing only looks for ride-start frames; wakeup() puts the normal filters back
+    if (sniff && setMode(MCP_MODE_CONFIG) == CAN_OK) {
+        programSniffFilters();
+        _sniff_filters = true;
+    }
+
     // Put the MCP into sleep mode (lowest power mode)
     if (sleep() == CAN_OK) {
         mcp_log.trace("Enter sleep mode OK");
@@ -43,7 +787,10 @@ void BikeCANBus::sleepCallback() {
     digitalWrite(CAN_STBY, HIGH);                   // Put CAN TXR in standby using the STBY pin (disables oscillator)
     
     mcp2515_initCANBuffers();                       // Clear out CAN buffers before sleep, as they may have stale data in them
-    mcp2515_setRegister(MCP_CANINTE, MCP_WAKIF);    // Enable CAN wake interrupt only
+
+    // Enable CAN wake interrupt only, unless we are sniffing: then nothing on the bus wakes us and
+    // the MCP only comes up in sniff()
+    mcp2515_setRegister(MCP_CANINTE, sniff ? 0x00 : MCP_WAKIF);
 
     // Flag our RX buffers as empty again, in case we have received anything in between sleepPrepare and here
     mcp2515_setRegister(MCP_CANINTF, 0x00);
@@ -52,11 +799,83 @@ void BikeCANBus::sleepCallback() {
     // and trigger the interrupt if the CAN bus is active when we hit this routine.
 }
 
+// Called from a sniff wake with the rest of the system still asleep. Listens for up to window_ms for a
+// frame through the sniff filters. Returns true (and leaves the frame latched for wakeup()) if one
+// shows up, otherwise puts the MCP back to sleep.
+bool BikeCANBus::sniff(uint32_t window_ms) {
+    const std::lock_guard<RecursiveMutex> lock(_mcp_mutex);
+    long unsigned int start = millis();
+
+    digitalWrite(CAN_STBY, LOW);    // Bring the transceiver out of standby
+    delayMicroseconds(10);
+    mcp2515_setRegister(MCP_CANINTF, 0x00);
+    mcp2515_setRegister(MCP_CANINTE, MCP_RX0IF | MCP_RX1IF);
+    setMode(MCP_MODE_LISTENONLY);   // Leaves sleep; listen only so we never ACK or send error frames
+
+    bool seen = false;
+    while (millis() - start < window_ms) {
+        if (!digitalRead(CAN_INT)) {
+            seen = true;
+            break;
+        }
+        delay(1);
+    }
+
+    if (seen) {
+        _sniff_hits++;
+        _sniff_woke = true;
+    } else {
+        sleep();
+        mcp2515_setRegister(MCP_CANINTE, 0x00);
+        mcp2515_setRegister(MCP_CANINTF, 0x00);
+        digitalWrite(CAN_STBY, HIGH);
+    }
+
+    _sniff_count++;
+    _sniff_awake_ms += millis() - start;
+    return seen;
+}
+
+bool BikeCANBus::takeSniffWake() {
+    bool woke = _sniff_woke;
+    _sniff_woke = false;
+    return woke;
+}
+
+// Average current the sniff schedule adds over the MCP sleeping with bus wake, from the awake time
+// actually measured per sniff (window plus mode changes) and the rough figures in bike_canbus.h
+float BikeCANBus::getSniffCurrentModelUA(uint32_t interval_ms) {
+    if (interval_ms == 0) {
+        return 0.0f;
+    }
+    float awake_ms = (_sniff_count > 0) ? (float)_sniff_awake_ms / (float)_sniff_count : 0.0f;
+    awake_ms += BIKE_CAN_SNIFF_WAKE_OVERHEAD_MS;
+    return BIKE_CAN_SNIFF_SLEEP_UA + BIKE_CAN_SNIFF_AWAKE_UA * awake_ms / (float)interval_ms;
+}
+
 void BikeCANBus::wakeup() {
+    const std::lock_guard<RecursiveMutex> lock(_mcp_mutex);
+
+    _wake_ms = millis();
+    _wake_latency_pending = true;
+    _fault_start_ms = 0;            // Errors from before the sleep are cleared below
+
     mcp_log.trace("Wakeup");
     digitalWrite(CAN_STBY, LOW);    // Bring MCP out of standby
     delayMicroseconds(10);          // MCP needs 128 TOsc to begin: 128/20MHz = 6.4us
 
+    // The MCP has been listening since the bus woke it, so RX0/RX1 may already hold the frames
+    // that started the ride. Queue them before anything below touches the flags.
+    _wake_latched_frames = readReceiveBuffers();
+    if (_wake_latched_frames) {
+        mcp_log.info("%u frame(s) latched during wake", _wake_latched_frames);
+    }
+
+    if (_sniff_filters && setMode(MCP_MODE_CONFIG) == CAN_OK) {
+        _hw_filter_enabled = programAcceptanceFilters(_hw_filter_requested);
+        _sniff_filters = false;
+    }
+
     // Check for errors here, report out, clear error register
     uint8_t error;
     if (CAN_CTRLERROR == checkError(&error)) {
@@ -67,184 +886,222 @@ void BikeCANBus::wakeup() {
         mcp_log.trace("no errors on wake");
     }
 
-    // TODO: see if we really need to clear this out
-    mcp2515_setRegister(MCP_CANINTF, 0x00);                     // Clear interrupt flags and RX buffers. We throw out some data here, since we woke on CAN
+    // Clear the wake and error interrupt flags, but leave RX0IF/RX1IF alone: any frame that arrived
+    // after the read above stays in its buffer for the CAN thread
+    mcp2515_modifyRegister(MCP_CANINTF, (uint8_t)~(MCP_RX0IF | MCP_RX1IF), 0x00);
     mcp2515_setRegister(MCP_CANINTE, MCP_RX0IF | MCP_RX1IF);    // Enable our RX buffer interrupts, disable WAK interrupt
 
     setMode(MCP_MODE_NORMAL);       // The MCP wakes up in Listen Only mode, so we need to reset it to Normal mode
 
+    _rx_suspended = false;          // Let the CAN thread service RX interrupts again
+
     mcp_log.info("UP!");
 }
 
 void BikeCANBus::loop() {
-    // Handle received CAN data
-    if (!digitalRead(CAN_INT)) {
-        // Validate interrupt is because we have a message available
-        if (CAN_MSGAVAIL == checkReceive()) {
-            can_frame_t frame;
-            readMsgBufID(&frame.rxId, &frame.len, frame.rxBuf);
-            _last_can_frame_time_ms = millis();
-
-            if (_is_active == false) {
-                _is_active = true;
-                bike_can.info("CAN Bus activity detected");
-            }
-            
-            _fresh_data = processCANFrame(frame);
-        } else {
-            // some other trigger for INT 
-            mcp_log.warn("INT triggered, no messages: {CANINTE: 0x%02X, CANINTF: 0x%02X}", mcp2515_readRegister(MCP_CANINTE), mcp2515_readRegister(MCP_CANINTF));
-
-            uint8_t error;
-            if (CAN_CTRLERROR == checkError(&error)) {
-                // Getting a RX buffer overflow error (0xC0), presumably because
-                // the buffer fills up and we don't empty it if the tracker is caught unaware
-                // When waking from sleep, we need to clear the buffer errors and interrupt errors
-                // sort of a "soft reset"
-                // CHALLENGE: we won't wake up if the buffers are full....perhaps we turn this interrupt off
-                // and just clear the buffers occasionally?
-                if ( (error & MCP_EFLG_ERRORMASK) & (MCP_EFLG_RX0OVR | MCP_EFLG_RX1OVR) ) {
-                    Log.warn("RX Buffer(s) full: {0: %s, 1: %s}, clearing error", 
-                        (error & MCP_EFLG_RX0OVR) ? "TRUE" : "FALSE", 
-                        (error & MCP_EFLG_RX1OVR) ? "TRUE" : "FALSE"
-                    );
-                    mcp2515_modifyRegister(MCP_EFLG, (MCP_EFLG_RX0OVR | MCP_EFLG_RX1OVR), 0x00);
-                } else {
-                    mcp_log.error("Other MCP Error: 0x%02X", error);
-                }
-            }
+    // Follow changes to the hardware filter setting from the cloud
+    // and to the set of runtime signal IDs. Discovery needs to see every ID, and so do bus
+    // statistics while they are being published: behind the filters they only cover decoded IDs.
+    bool hw_filter = BikeConfig::instance().getCANHwFilterEnable() && !BikeCANDiscovery::instance().isEnabled() &&
+        !BikeConfig::instance().getCANStatsPublishEnable();
+    bool filter_changed = hw_filter != _hw_filter_requested || _hw_filter_generation != filterGeneration();
+    bool filter_due = !_hw_filter_retry || (long)(millis() - _hw_filter_retry_ms) >= 0;
+    if (_status == CAN_OK && !_probing && (filter_changed || _hw_filter_retry) && filter_due) {
+        _hw_filter_requested = hw_filter;
+        // A controller that will not enter config mode is retried on a timer, not on every pass
+        _hw_filter_retry = (setHwFilterEnable(hw_filter) == SYSTEM_ERROR_INVALID_STATE);
+        if (_hw_filter_retry) {
+            _hw_filter_retry_ms = millis() + BIKE_CAN_FILTER_RETRY_MS;
         }
     }
 
-    if (_is_active == true && millis() - _last_can_frame_time_ms > BIKE_CAN_INACTIVITY_PERIOD_S*1000) {
-        _is_active = false;
-        bike_can.info("CAN Bus inactivity detected (idle for %u seconds)", BIKE_CAN_INACTIVITY_PERIOD_S);
-    }
-}
+    dispatchTransmitCallbacks();
 
-void BikeCANBus::getBikeData(bike_data_t &data) {
-    memcpy(&data, &_bike_data, sizeof(bike_data_t));
-    _fresh_data = false;
-}
+    // Decode the frames queued up by the CAN thread
+    can_frame_t frame;
+    unsigned int count = 0;
+    bool decoded = false;
+    while (count < BIKE_CAN_RX_BATCH_MAX && _rx_ring.pop(frame)) {
+        count++;
+        _activity.frame(frame.rxId, frame.rxTimeMs);
+        BikeCANStats::instance().recordFrame(frame);
 
-// This section contains vehicle-specific CAN frame processing code
-bool BikeCANBus::processCANFrame(can_frame_t &frame) {
-    bool success = false;
-    
-    // Log raw bytes
-    if (bike_can_raw.isTraceEnabled()) {
-        char data_str[32];
-        for (unsigned char i = 0; i < frame.len; i++) {
-            sprintf(&(data_str[i*3]), " %02x", frame.rxBuf[i]);
-        }
-        bike_can_raw.trace("%08lx:%s", frame.rxId, data_str);
-    }
-
-    switch(frame.rxId) {
-        // Assist Level (4 bytes)
-        // [0]   Assist level
-        // [3:1] Unknown / 0
-        case 0x03B: {
-            if (frame.len == 4) {
-                _bike_data.pas_level = frame.rxBuf[0];
-                bike_can_raw.info("Assist Level Frame: {pas_level: %d}", _bike_data.pas_level);
-                success = true;
-            }
-            break;
+        if (_is_active == false) {
+            _is_active = true;
+            bike_can.info("CAN Bus activity detected");
         }
 
-        // Speed (2 bytes)
-        // [1:0] Speed in 0.01 km/h or 1/360 m/s
-        case 0x0D1: {
-            if (frame.len == 2) {
-                uint16_t speed_temp;
-                speed_temp  = (uint16_t)(frame.rxBuf[0] << 8);
-                speed_temp |= (uint16_t)(frame.rxBuf[1]);
-                _bike_data.speed = ((float)speed_temp) / 100.0f; // to km/h
-                // _bike_data.speed = ((float)speed_temp) / 360.0f; // to m/s
-                bike_can_raw.info("Speed Frame: {speed: %0.2f km/h (raw=%d)}", _bike_data.speed, speed_temp);
-                success = true;
-            }
-            break;
+        if (processCANFrame(frame)) {
+            decoded = true;
         }
-        
-        // Charge Status (7 bytes)
-        // [4:0] Unknown
-        // [5]   Battery capacity, 0.1 Ah
-        // [6]   Battery percent, %
-        case 0x111: {
-            if (frame.len == 7) {
-                _bike_data.battery_capacity = ((float)frame.rxBuf[5]) / 10.0f;
-                _bike_data.battery_pct      = frame.rxBuf[6];
-                bike_can_raw.info("Charge Status Frame: {capacity: %0.1fAh, charge: %u%%}", _bike_data.battery_capacity, _bike_data.battery_pct);
-                success = true;
-            }
-            break;
+        BikeCANDiscovery::instance().recordFrame(frame, _bike_data);
+        BikeCANDiag::instance().processFrame(frame);
+    }
+
+    if (decoded) {
+        _snapshot.write(_bike_data);
+
+        if (_wake_latency_pending) {
+            _wake_latency_pending = false;
+            _wake_latency_ms = millis() - _wake_ms;
+            bike_can.info("First frame decoded %lu ms after wake (%u latched)", _wake_latency_ms, _wake_latched_frames);
         }
-        
-        // Odometer Frame (8 bytes)
-        // [3:0] Odometer reading, meters
-        // [7:4] Unknown
-        case 0x202: {
-            if (frame.len == 8) {
-                _bike_data.odometer  = (uint32_t)(frame.rxBuf[0] << 24);
-                _bike_data.odometer |= (uint32_t)(frame.rxBuf[1] << 16);
-                _bike_data.odometer |= (uint32_t)(frame.rxBuf[2] <<  8);
-                _bike_data.odometer |= (uint32_t)(frame.rxBuf[3]);
-                bike_can_raw.info("Odometer Frame: {odo: %12ldm}", _bike_data.odometer);
-                success = true;
-            }
-            break;
+    }
+
+    if (_triage_state != BIKE_CAN_TRIAGE_NONE) {
+        updateTriage(decoded);
+    }
+
+    // Events go out after the snapshot is written, so listeners see the data that caused them
+    if (_is_active && !_active_dispatched && _triage_state == BIKE_CAN_TRIAGE_NONE) {
+        _active_dispatched = true;
+        dispatchEvent(BIKE_CAN_EVENT_ACTIVE);
+    }
+    if (decoded) {
+        dispatchEvent(BIKE_CAN_EVENT_DATA);
+    }
+
+    if (!_heartbeat_logged) {
+        uint16_t id;
+        uint32_t period_ms;
+        if (_activity.getHeartbeat(id, period_ms)) {
+            _heartbeat_logged = true;
+            bike_can.info("Learned heartbeat 0x%03x every %lu ms, idle after %lu ms", id, period_ms, getInactivityTimeoutMs());
         }
+    }
 
-        // Battery (8 bytes)
-        // [3:0] Time since full, seconds
-        // [4]   Battery percent, %
-        // [5:7] Unknown
-        case 0x203: {
-            if (frame.len == 8) {
-                _bike_data.battery_time_since_full  = (uint32_t)(frame.rxBuf[0] << 24);
-                _bike_data.battery_time_since_full |= (uint32_t)(frame.rxBuf[1] << 16);
-                _bike_data.battery_time_since_full |= (uint32_t)(frame.rxBuf[2] <<  8);
-                _bike_data.battery_time_since_full |= (uint32_t)(frame.rxBuf[3]);
-                uint8_t pct_temp = frame.rxBuf[4];
-                bike_can_raw.info("Battery Frame: {time_since_full: %lus, charge: %u%%}", _bike_data.battery_time_since_full, pct_temp);
-                success = true;
-            }
-            break;
+    // Judge silence by the newest frame the CAN thread received, not the last one decoded: frames
+    // still queued after a slow loop() mean the bus was talking. last_rx_ms is read after the ring
+    // and before the clock, so a frame arriving in between only makes the bus look busier.
+    uint32_t miss_periods = BikeConfig::instance().getCANMissPeriods();
+    bool queued = !_rx_ring.isEmpty();
+    long unsigned int last_rx_ms = _last_can_frame_time_ms;
+    if (_is_active == true && !queued && _activity.isIdle(millis(), last_rx_ms, miss_periods, BIKE_CAN_INACTIVITY_PERIOD_S*1000)) {
+        _is_active = false;
+        bike_can.info("CAN Bus inactivity detected (idle for %lu ms)", millis() - last_rx_ms);
+        _wake_latency_pending = false;     // Whatever woke us was not a ride
+
+        bike_can_counters_t counters;
+        getCounters(counters);
+        bike_can.info("RX counters: {frames: %lu, dropped: %lu, overflows: %lu, spi: %lu, unhandled: %lu}",
+            counters.rx_frames, counters.rx_dropped, counters.rx_overflows, counters.rx_spi_transactions, counters.rx_unhandled);
+        bike_can.info("TX counters: {frames: %lu, errors: %lu}", counters.tx_frames, counters.tx_errors);
+        bike_can.info("Error counters: {state: %s, tec: %u, rec: %u, bus_off: %lu, resets: %lu, recovery: %lu/%lu ms}",
+            errorStateToStr(counters.error_state), counters.tec, counters.rec, counters.bus_off_count, counters.controller_resets,
+            counters.last_recovery_ms, counters.max_recovery_ms);
+
+        // Nobody was told about activity that triage held back
+        if (_active_dispatched) {
+            _active_dispatched = false;
+            dispatchEvent(BIKE_CAN_EVENT_INACTIVE);
         }
+    }
+}
 
-        default:
-            bike_can_raw.trace("Unknown Frame: 0x%04lX (%u bytes)", frame.rxId, frame.len);
-            break;
-        
+uint32_t BikeCANBus::getInactivityTimeoutMs() {
+    return _activity.timeoutMs(BikeConfig::instance().getCANMissPeriods(), BIKE_CAN_INACTIVITY_PERIOD_S*1000);
+}
+
+void BikeCANBus::startWakeTriage(uint32_t window_ms) {
+    _triage_state = BIKE_CAN_TRIAGE_COLLECTING;
+    _triage_start_ms = millis();
+    _triage_window_ms = window_ms;
+    _triage_pas_level = _bike_data.pas_level;
+    bike_can.info("Wake triage: collecting frames for %lu ms", window_ms);
+}
+
+void BikeCANBus::updateTriage(bool decoded) {
+    if (decoded) {
+        // Only values decoded since the wake count, the rest is left over from before we slept
+        const long unsigned int *updated = _bike_data.updated_ms;
+        bool speed = updated[BIKE_DATA_SPEED] && (long)(updated[BIKE_DATA_SPEED] - _triage_start_ms) >= 0 && _bike_data.speed > 0.0f;
+        bool pas = updated[BIKE_DATA_PAS_LEVEL] && (long)(updated[BIKE_DATA_PAS_LEVEL] - _triage_start_ms) >= 0 && _bike_data.pas_level != _triage_pas_level;
+        if (speed || pas) {
+            bike_can.info("Wake triage: ride starting (%s) after %lu ms", speed ? "speed" : "pas", millis() - _triage_start_ms);
+            _triage_state = BIKE_CAN_TRIAGE_NONE;
+            return;
+        }
     }
 
-    return success;
+    if (_triage_state == BIKE_CAN_TRIAGE_COLLECTING && millis() - _triage_start_ms >= _triage_window_ms) {
+        _triage_state = BIKE_CAN_TRIAGE_NOISE;
+        _avoided_wakes++;
+        bike_can.info("Wake triage: no ride, staying off the network (%lu wakes avoided)", _avoided_wakes);
+    }
 }
 
-void BikeCANBus::sendDisplayCommand(display_cmd_t cmd) {
-    // byte trySendMsgBuf(unsigned long id, byte ext, byte rtrBit, byte len, const byte* buf, byte iTxBuf = 0xff); 
-    // as sendMsgBuf, but does not have any wait for free buffer
-    uint8_t data[] = {0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, (uint8_t)cmd};
+int BikeCANBus::registerEventCallback(BikeCANEventCallback callback) {
+    _event_callbacks.append(callback);
+    return SYSTEM_ERROR_NONE;
+}
 
-    if (CAN_OK == trySendMsgBuf(BOSCH_DISPLAY_COMMAND_ID, 0, 0, 8, data)) {
-        bike_can.info("Display Command 0x%02X SUCCESS", (uint8_t)cmd);
-    } else {
-        bike_can.error("Display Command 0x%02X FAIL", (uint8_t)cmd);
+void BikeCANBus::dispatchEvent(bike_can_event_t event) {
+    for (auto callback : _event_callbacks) {
+        callback(event);
     }
 }
 
-void BikeCANBus::turnBikeOff() {
-    sendDisplayCommand(display_cmd_t::on_off);
-    for (int i = 0; i < 3; i++) {
-        if (CAN_OK == trySendMsgBuf(BOSCH_OFF_COMMAND_ID, 0, 0, 1, {0x00})) {
-            bike_can.info("Sent Off Command 0x61 ��%u", i);
-        } else {
-            bike_can.error("Off Command 0x61  ��%u FAIL", i);
-            return;
+void BikeCANBus::getBikeData(bike_data_t &data) {
+    _snapshot.read(data);
+}
+
+bool BikeCANBus::getBikeData(bike_data_t &data, uint32_t &cursor) {
+    uint32_t version = _snapshot.read(data);
+    bool fresh = (version != cursor);
+    cursor = version;
+    return fresh;
+}
+
+// static
+uint32_t BikeCANBus::getStaleFields(const bike_data_t &data, long unsigned int now_ms) {
+    uint32_t stale = 0;
+    for (size_t i = 0; i < BIKE_DATA_NUM_FIELDS; i++) {
+        long unsigned int updated = data.updated_ms[i];
+        int32_t max_age = BikeConfig::instance().getMaxFieldAgeMs((bike_data_field_t)i);
+        if (updated == 0 || (now_ms - updated) > (long unsigned int)max_age) {
+            stale |= BIKE_DATA_FIELD_MASK(i);
         }
-        delay(10);
     }
-    bike_can.info("Bike should be off?");
-}
\ No newline at end of file
+    return stale;
+}
+
+// Vehicle-specific signal definitions live in bike_can_decoder.h
+bool BikeCANBus::processCANFrame(can_frame_t &frame) {
+    // Log raw bytes, big endian words so the host prints them in bus order
+    BikeBinLog &blog = BikeBinLog::instance();
+    if (blog.isEnabled(BLOG_CAN_FRAME, LOG_LEVEL_TRACE)) {
+        uint8_t bytes[8] = { 0 };
+        memcpy(bytes, frame.rxBuf, (frame.len <= 8) ? frame.len : 8);
+        blog.trace(BLOG_CAN_FRAME, frame.rxId, frame.len,
+            ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3],
+            ((uint32_t)bytes[4] << 24) | ((uint32_t)bytes[5] << 16) | ((uint32_t)bytes[6] << 8) | bytes[7]);
+    }
+
+    bool decoded = bike_can_decoder.decode(frame, _bike_data);
+
+    // Signals defined at runtime through the can_signals config module
+    bool generic = BikeCANSignals::instance().processCANFrame(frame);
+
+    if (!decoded && !generic && !bike_can_decoder.findMessage(frame.rxId)) {
+        _rx_unhandled++;
+        blog.trace(BLOG_CAN_UNKNOWN, frame.rxId, frame.len);
+    }
+    return decoded;
+}
+
+int BikeCANBus::sendDisplayCommand(display_cmd_t cmd, BikeCANTxCallback callback) {
+    uint8_t data[] = {0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, (uint8_t)cmd};
+    return queueTransmit(BOSCH_DISPLAY_COMMAND_ID, sizeof(data), data, 1, 0, callback);
+}
+
+// Display on/off button press, then the off command three times 10 ms apart. callback reports on the
+// off command.
+int BikeCANBus::turnBikeOff(BikeCANTxCallback callback) {
+    int ret = sendDisplayCommand(display_cmd_t::on_off);
+    if (ret != SYSTEM_ERROR_NONE) {
+        return ret;
+    }
+
+    const uint8_t data[] = {0x00};
+    return queueTransmit(BOSCH_OFF_COMMAND_ID, sizeof(data), data, 3, 10, callback);
+}
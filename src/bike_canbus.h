@@ -2,30 +2,117 @@
 #ifndef _BIKE_CANBUS_H
 #define _BIKE_CANBUS_H
 
+#include <atomic>
+
 #include "mcp_can.h"
 #include "mcp_can_dfs.h"
+#include "bike_can_activity.h"
+#include "bike_can_ring.h"
+#include "bike_seqlock.h"
+#include "bike_data.h"
+
+#define BIKE_CAN_SPEED                  CAN_500KBPS // Rate until one is detected, and the first one probed
+#define BIKE_CAN_BITRATE                (500000)    // BIKE_CAN_SPEED in bit/s
+#define BIKE_CAN_INACTIVITY_PERIOD_S    5       // Idle timeout until frame periods are learned, and its upper bound
+
+#define BIKE_CAN_THREAD_PRIORITY        (OS_THREAD_PRIORITY_DEFAULT + 1)
+#define BIKE_CAN_THREAD_POLL_MS         10      // Fallback poll of CAN_INT in case an edge is missed
+#define BIKE_CAN_RX_RING_SIZE           64      // Frames buffered between the CAN thread and loop(), power of two
+#define BIKE_CAN_RX_DRAIN_MAX           16      // Max frames read from the MCP per wake of the CAN thread
+#define BIKE_CAN_RX_BATCH_MAX           32      // Max frames decoded per call to loop()
+// Rough current figures for the sniff model: MCP25625 controller and transceiver asleep, and the
+// Tracker awake with modem and GNSS off while a sniff window is open
+#define BIKE_CAN_SNIFF_SLEEP_UA         (6.0f)
+#define BIKE_CAN_SNIFF_AWAKE_UA         (15000.0f)
+#define BIKE_CAN_SNIFF_WAKE_OVERHEAD_MS (5.0f)     // Leaving and re-entering system sleep
+
+#define BIKE_CAN_ERROR_POLL_MS          100     // How often the CAN thread reads TEC/REC/EFLG
+#define BIKE_CAN_FAULT_RESET_MS         500     // Bus-off, or error passive with no frames, for this long resets the controller
+#define BIKE_CAN_RESET_BACKOFF_MAX_MS   30000   // Resets back off by doubling up to this, which bounds recovery time
 
-#define BIKE_CAN_SPEED                  CAN_500KBPS
-#define BIKE_CAN_INACTIVITY_PERIOD_S    5
+#define BIKE_CAN_PROBE_WINDOW_MS        250     // Listen time per candidate bit rate
+#define BIKE_CAN_PROBE_MIN_FRAMES       3       // Good frames needed, with no errors, to accept a rate
+#define BIKE_CAN_REPROBE_RESETS         3       // Resets in a row with nothing received before the rate is probed again
+#define BIKE_CAN_RATE_FILE              "/usr/can_rate"
+
+#define BIKE_CAN_TX_QUEUE_SIZE          8       // Transmit jobs queued or waiting for their completion callback
+#define BIKE_CAN_TX_TIMEOUT_MS          50      // Give up on a frame the MCP has not sent by then (no ACK, bus off)
+#define BIKE_CAN_FILTER_RETRY_MS        5000    // Wait before reprogramming the filters after the MCP refused config mode
+
+#ifndef BIKE_CAN_FAST_RX
+// Read RX0/RX1 with the MCP READ STATUS and READ RX BUFFER instructions instead of the MCP_CAN
+// register-by-register path: one status read per pass plus one chip select burst per frame
+#define BIKE_CAN_FAST_RX                (1)
+#endif
 
 #define BOSCH_DISPLAY_COMMAND_ID        (0x131)
 #define BOSCH_OFF_COMMAND_ID            (0x061)
 #define BOSCH_ON_COMMAND_ID             (0x055)
 
+// Error confinement state of the MCP, from EFLG
+typedef enum : uint8_t {
+    BIKE_CAN_ERR_ACTIVE,
+    BIKE_CAN_ERR_WARNING,           // TEC or REC at 96 or above
+    BIKE_CAN_ERR_PASSIVE,           // TEC or REC at 128 or above
+    BIKE_CAN_ERR_BUS_OFF,           // TEC above 255, the MCP is off the bus
+} bike_can_error_state_t;
+
 typedef struct {
-    uint8_t pas_level;
-    float speed;
-    float battery_capacity;
-    uint8_t battery_pct;
-    uint32_t odometer;
-    uint32_t battery_time_since_full;
-} bike_data_t;
+    uint32_t rx_frames;             // Frames read out of the MCP
+    uint32_t rx_dropped;            // Frames lost because the RX ring was full
+    uint32_t rx_overflows;          // MCP RX0OVR/RX1OVR events (frames lost in the controller)
+    uint32_t rx_spi_transactions;   // SPI transactions spent on the receive path
+    uint32_t rx_unhandled;          // Frames that crossed SPI but have no decoder (traffic the filters let through)
+    uint32_t tx_frames;             // Frames the MCP reported sent (TX0IF)
+    uint32_t tx_errors;             // Frames that hit TXERR or timed out
+    uint32_t wake_latched_frames;   // Frames already in RX0/RX1 when the last wake got to the MCP
+    uint32_t wake_latency_ms;       // Last wake to first decoded frame
+    uint8_t tec;                    // Transmit and receive error counters as of the last poll
+    uint8_t rec;
+    uint8_t eflg;
+    bike_can_error_state_t error_state;
+    uint32_t bus_off_count;         // Times the MCP went bus-off
+    uint32_t controller_resets;     // Resets and reinits by the error supervisor
+    uint32_t last_recovery_ms;      // Fault (bus-off or silent error passive) to error active, last and worst
+    uint32_t max_recovery_ms;
+} bike_can_counters_t;
+
+typedef enum {
+    BIKE_CAN_EVENT_ACTIVE,          // First frame after the bus was idle
+    BIKE_CAN_EVENT_INACTIVE,        // No frames for a few heartbeat periods (see BikeCANActivity)
+    BIKE_CAN_EVENT_DATA,            // New bike data was decoded
+} bike_can_event_t;
+
+using BikeCANEventCallback = std::function<void(bike_can_event_t event)>;
+
+typedef enum {
+    BIKE_CAN_TRIAGE_NONE,           // Activity is reported as it happens
+    BIKE_CAN_TRIAGE_COLLECTING,     // Woke on CAN, deciding whether a ride is starting
+    BIKE_CAN_TRIAGE_NOISE,          // Decided it was not a ride; stay quiet unless one starts before we sleep
+} bike_can_triage_t;
+
+typedef enum {
+    BIKE_CAN_TX_OK,                 // Every repeat was sent
+    BIKE_CAN_TX_ERROR,              // The MCP flagged TXERR and the frame was aborted
+    BIKE_CAN_TX_TIMEOUT,            // Not sent within BIKE_CAN_TX_TIMEOUT_MS (nobody to ACK it, or the MCP went to sleep)
+} bike_can_tx_result_t;
+
+// id, result and how many of the repeats actually made it onto the bus
+using BikeCANTxCallback = std::function<void(long unsigned int id, bike_can_tx_result_t result, uint8_t sent)>;
 
 typedef struct {
-    long unsigned int rxId;
-    unsigned char len;
-    unsigned char rxBuf[8];
-} can_frame_t;
+    long unsigned int id;
+    uint8_t len;
+    uint8_t buf[8];
+    uint8_t repeat;                 // Times left to send
+    uint8_t sent;
+    uint16_t spacing_ms;            // Gap between repeats
+    long unsigned int next_send_ms;
+    long unsigned int started_ms;   // When the current repeat was handed to the MCP, 0 if not in flight
+    bool tx_error;                  // TXERR seen on the current repeat
+    bike_can_tx_result_t result;
+    BikeCANTxCallback callback;
+} bike_can_tx_job_t;
 
 typedef enum {
     asst_plus   = 0x00,
@@ -48,55 +135,276 @@ class BikeCANBus : public MCP_CAN {
 
         BikeCANBus() : 
             MCP_CAN{ CAN_CS, SPI1 },
+            _status(CAN_FAILINIT),
+            _can_speed(BIKE_CAN_SPEED),
+            _can_speed_confirmed(false),
+            _probing(false),
+            _silent_resets(0),
             _bike_data({
                 .pas_level = 0,
                 .speed = 0.0f,
                 .battery_capacity = 0.0f,
                 .battery_pct = 0,
                 .odometer = 0,
-                .battery_time_since_full = 0
+                .battery_time_since_full = 0,
+                .updated_ms = {}
             }),
             _last_can_frame_time_ms(0),
-            _fresh_data(false)
+            _is_active(false),
+            _heartbeat_logged(false),
+            _thread(nullptr),
+            _rx_event_queue(nullptr),
+            _rx_suspended(false),
+            _rx_frames(0),
+            _rx_dropped(0),
+            _rx_overflows(0),
+            _rx_spi_transactions(0),
+            _rx_unhandled(0),
+            _tx_frames(0),
+            _tx_errors(0),
+            _tx_head(0),
+            _tx_count(0),
+            _tx_done_count(0),
+            _wake_ms(0),
+            _wake_latency_pending(false),
+            _wake_latched_frames(0),
+            _wake_latency_ms(0),
+            _active_dispatched(false),
+            _triage_state(BIKE_CAN_TRIAGE_NONE),
+            _triage_start_ms(0),
+            _triage_window_ms(0),
+            _triage_pas_level(0),
+            _avoided_wakes(0),
+            _avoided_wakes_reported(0),
+            _sniff_filters(false),
+            _sniff_woke(false),
+            _sniff_count(0),
+            _sniff_hits(0),
+            _sniff_awake_ms(0),
+            _tec(0),
+            _rec(0),
+            _eflg(0),
+            _error_state(BIKE_CAN_ERR_ACTIVE),
+            _bus_off_count(0),
+            _controller_resets(0),
+            _last_recovery_ms(0),
+            _max_recovery_ms(0),
+            _error_poll_ms(0),
+            _fault_start_ms(0),
+            _fault_rx_frames(0),
+            _reset_backoff_ms(BIKE_CAN_FAULT_RESET_MS),
+            _next_reset_ms(0),
+            _healthy_since_ms(0),
+            _hw_filter_requested(false),
+            _hw_filter_enabled(false),
+            _hw_filter_generation(0),
+            _hw_filter_retry(false),
+            _hw_filter_retry_ms(0)
         {
         };
 
         void setup();
         void loop();
 
+        // Consistent copy of the latest decoded bike data. Safe from any thread.
         void getBikeData(bike_data_t &data);
+
+        // As above, for a reader keeping its own freshness cursor: returns true if the data changed
+        // since the version in cursor, and moves cursor to the version copied out
+        bool getBikeData(bike_data_t &data, uint32_t &cursor);
         bool processCANFrame(can_frame_t &frame);
-        void canThreadFunction(void *param);
+
+        // Fields of data that were never received, or are older than their configured max age
+        static uint32_t getStaleFields(const bike_data_t &data, long unsigned int now_ms);
+        static inline bool isFieldStale(uint32_t stale, bike_data_field_t field) {
+            return (stale & BIKE_DATA_FIELD_MASK(field)) != 0;
+        }
+
+        static void canThreadFunction(void *param);
+
+        void getCounters(bike_can_counters_t &counters);
+
+        int setHwFilterEnable(bool enable);
+        inline bool isHwFilterEnabled() {
+            return _hw_filter_enabled;
+        }
 
         void sleepPrepareCallback();
-        void sleepCallback();
+        void sleepCallback(bool sniff = false);
         void wakeup();
 
+        // Sniff schedule (TrackerSleep::sniffEvery): open a listen window on the MCP from sleep
+        bool sniff(uint32_t window_ms);
+
+        // True once after the sniff that ended the last sleep
+        bool takeSniffWake();
+
+        inline uint32_t getSniffCount() {
+            return _sniff_count;
+        }
+        inline uint32_t getSniffHits() {
+            return _sniff_hits;
+        }
+
+        // Modelled average current, in uA, of sniffing every interval_ms
+        float getSniffCurrentModelUA(uint32_t interval_ms);
+
         inline bool isActive() {
             return _is_active;
         }
 
-        // TODO: Add activity change callback!
+        // Hold back the ACTIVE event after a CAN wake until the frames show a ride starting (speed
+        // above 0 or a PAS change). If window_ms passes without one, the wake counts as avoided and
+        // the device can go back to sleep without bringing up the network. Call before wakeup().
+        void startWakeTriage(uint32_t window_ms);
+
+        inline bike_can_triage_t getTriageState() {
+            return _triage_state;
+        }
+
+        // Full wakes avoided and not yet reported; ackAvoidedWakes() once a publish carrying them went out
+        inline uint32_t getAvoidedWakes() {
+            return _avoided_wakes - _avoided_wakes_reported;
+        }
+
+        inline void ackAvoidedWakes(uint32_t count) {
+            _avoided_wakes_reported += count;
+        }
+
+        // Called from loop() on the application thread, never from the interrupt or the CAN thread
+        int registerEventCallback(BikeCANEventCallback callback);
+
+        inline bool isDataFresh(uint32_t cursor) {
+            return _snapshot.version() != cursor;
+        }
+
+        inline bike_can_error_state_t getErrorState() {
+            return _error_state;
+        }
 
-        inline bool isDataFresh() {
-            return _fresh_data;
+        // Bus bit rate in use, bit/s
+        inline uint32_t getBitrate() {
+            return bitrateForSpeed(_can_speed);
         }
+        static uint32_t bitrateForSpeed(uint8_t speed);
 
         inline long unsigned int getLastFrameTimeMs() {
             return _last_can_frame_time_ms;
         }
 
-        void sendDisplayCommand(display_cmd_t cmd);
-        void turnBikeOff();
+        // Silence that currently counts as the bus going idle, learned from the frame periods
+        uint32_t getInactivityTimeoutMs();
+
+        // Queue a frame to be sent repeat times, spacing_ms apart, by the CAN thread. Returns right away;
+        // callback (optional) is called from loop() once the last repeat is sent or the job fails.
+        int queueTransmit(long unsigned int id, uint8_t len, const uint8_t *buf, uint8_t repeat = 1, uint16_t spacing_ms = 0,
+            BikeCANTxCallback callback = nullptr);
+
+        int sendDisplayCommand(display_cmd_t cmd, BikeCANTxCallback callback = nullptr);
+        int turnBikeOff(BikeCANTxCallback callback = nullptr);
 
     private:
         static BikeCANBus *_instance;
         byte _status;
+        std::atomic<uint8_t> _can_speed;    // MCP_CAN CAN_xxxKBPS code
+        bool _can_speed_confirmed;          // Frames were seen at _can_speed, rather than it being the default
+        std::atomic<bool> _probing;
+        uint32_t _silent_resets;            // Controller resets in a row that did not bring any frames
 
-        bike_data_t _bike_data;
-        long unsigned int _last_can_frame_time_ms;
-        bool _fresh_data;
+        bike_data_t _bike_data;                 // Decoder working copy, only touched from loop()
+        BikeSeqlock<bike_data_t> _snapshot;     // What readers see, updated once per decoded batch
+        std::atomic<long unsigned int> _last_can_frame_time_ms;    // Newest frame the CAN thread received, decoded or not
         bool _is_active;
+        BikeCANActivity _activity;      // Only touched from loop()
+        bool _heartbeat_logged;
+
+        // CAN receive thread: woken by CAN_INT, drains the MCP into _rx_ring which loop() consumes
+        os_thread_t _thread;
+        os_queue_t _rx_event_queue;
+        RecursiveMutex _mcp_mutex;      // Serializes MCP access between the CAN thread and the application
+        BikeCANRing<can_frame_t, BIKE_CAN_RX_RING_SIZE> _rx_ring;
+        std::atomic<bool> _rx_suspended;
+
+        std::atomic<uint32_t> _rx_frames;
+        std::atomic<uint32_t> _rx_dropped;
+        std::atomic<uint32_t> _rx_overflows;
+        std::atomic<uint32_t> _rx_spi_transactions;
+        std::atomic<uint32_t> _rx_unhandled;
+        std::atomic<uint32_t> _tx_frames;
+        std::atomic<uint32_t> _tx_errors;
+
+        // Transmit jobs in FIFO order, the head one is on TXB0. Finished jobs wait in _tx_done for
+        // loop() to call their callbacks. Both are protected by _mcp_mutex.
+        bike_can_tx_job_t _tx_jobs[BIKE_CAN_TX_QUEUE_SIZE];
+        size_t _tx_head;
+        size_t _tx_count;
+        bike_can_tx_job_t _tx_done[BIKE_CAN_TX_QUEUE_SIZE];
+        size_t _tx_done_count;
+
+        long unsigned int _wake_ms;
+        bool _wake_latency_pending;     // Waiting for the first decoded frame since wakeup()
+        uint32_t _wake_latched_frames;
+        uint32_t _wake_latency_ms;
+
+        bool _active_dispatched;        // ACTIVE went out and INACTIVE has not yet
+        bike_can_triage_t _triage_state;
+        long unsigned int _triage_start_ms;
+        uint32_t _triage_window_ms;
+        uint8_t _triage_pas_level;      // Assist level before the wake, a change means someone is riding
+        uint32_t _avoided_wakes;
+        uint32_t _avoided_wakes_reported;
+
+        bool _sniff_filters;            // Acceptance filters hold the sniff set, not the decoded IDs
+        bool _sniff_woke;
+        uint32_t _sniff_count;
+        uint32_t _sniff_hits;
+        uint32_t _sniff_awake_ms;       // Total time the MCP was up for sniffs
+
+        // Error supervisor, run from the CAN thread
+        std::atomic<uint8_t> _tec;
+        std::atomic<uint8_t> _rec;
+        std::atomic<uint8_t> _eflg;
+        std::atomic<bike_can_error_state_t> _error_state;
+        std::atomic<uint32_t> _bus_off_count;
+        std::atomic<uint32_t> _controller_resets;
+        std::atomic<uint32_t> _last_recovery_ms;
+        std::atomic<uint32_t> _max_recovery_ms;
+        long unsigned int _error_poll_ms;
+        long unsigned int _fault_start_ms;      // 0 while there is no fault
+        uint32_t _fault_rx_frames;              // _rx_frames when the fault started, to tell a silent bus
+        uint32_t _reset_backoff_ms;
+        long unsigned int _next_reset_ms;
+        long unsigned int _healthy_since_ms;
+
+        Vector<BikeCANEventCallback> _event_callbacks;
+
+        bool _hw_filter_requested;
+        bool _hw_filter_enabled;
+        uint32_t _hw_filter_generation;     // BikeCANSignals plan and BikeCANDiag slots the filters were built for
+        bool _hw_filter_retry;              // Last reprogramming failed, try again at _hw_filter_retry_ms
+        long unsigned int _hw_filter_retry_ms;
+
+        void canInterruptHandler();
+        void drainReceiveBuffers();
+        unsigned int readReceiveBuffers();
+        void queueFrame(can_frame_t &frame);
+        uint8_t readStatusFast();
+        void readRxBufferFast(uint8_t buffer, can_frame_t &frame);
+        bool programAcceptanceFilters(bool enable);
+        void programSniffFilters();
+        void writeAcceptanceFilters(const uint16_t *ids, size_t num_ids);
+        void checkControllerErrors();
+        void superviseErrors();
+        bool resetController();
+        uint8_t probeBitrate(uint8_t first);
+        void reprobeBitrate();
+        bool loadBitrate();
+        void saveBitrate();
+        unsigned int serviceTransmit();
+        void finishTransmit(bike_can_tx_result_t result);
+        void dispatchTransmitCallbacks();
+        void dispatchEvent(bike_can_event_t event);
+        void updateTriage(bool decoded);
 };
 
 #endif // _BIKE_CANBUS_H
\ No newline at end of file
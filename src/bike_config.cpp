@@ -7,6 +7,7 @@ void BikeConfig::setup() {
     static ConfigObject bikeConfigDesc("bike", {
         ConfigInt("can_idle_timeout", &can_idle_timeout_s, 10, 60*60),
         ConfigFloat("publish_trigger_speed", &publish_trigger_speed_kmph, 0.1, 36.0),
+        ConfigInt("publish_distance", &publish_distance_m, 0, 100000),
         ConfigBool("udr_enable", 
             [this](bool &value, const void *context) {
                 // Get thing from class
@@ -19,7 +20,42 @@ void BikeConfig::setup() {
                 Log.info("udr_enable = %s", value ? "true" : "false");
                 return 0;
             }
-        )
+        ),
+        ConfigBool("can_hw_filter", &enable_can_hw_filter),
+        ConfigBool("can_stats_loc", &enable_can_stats_publish),
+        ConfigInt("can_wake_triage", &can_wake_triage_ms, 0, 30000),
+        ConfigInt("can_miss", &can_miss_periods, 0, 100),
+        ConfigObject("max_age", {
+            ConfigInt("pas", &max_field_age_ms[BIKE_DATA_PAS_LEVEL], 100, 60*60*1000),
+            ConfigInt("sp", &max_field_age_ms[BIKE_DATA_SPEED], 100, 60*60*1000),
+            ConfigInt("cap", &max_field_age_ms[BIKE_DATA_BATTERY_CAPACITY], 100, 60*60*1000),
+            ConfigInt("bt", &max_field_age_ms[BIKE_DATA_BATTERY_PCT], 100, 60*60*1000),
+            ConfigInt("odo", &max_field_age_ms[BIKE_DATA_ODOMETER], 100, 60*60*1000),
+            ConfigInt("tsf", &max_field_age_ms[BIKE_DATA_BATTERY_TIME_SINCE_FULL], 100, 60*60*1000)
+        }),
+        ConfigObject("sniff", {
+            ConfigInt("interval", &sniff_interval_ms, 0, 60*60*1000),
+            ConfigInt("window", &sniff_window_ms, 10, 5000)
+        }),
+        ConfigObject("blog", {
+            ConfigInt("sink", &blog_sink, BIKE_BLOG_SINK_SERIAL, BIKE_BLOG_SINK_FLASH),
+            ConfigInt("can", &blog_levels[BIKE_BLOG_CAT_CAN], LOG_LEVEL_ALL, LOG_LEVEL_NONE),
+            ConfigInt("raw", &blog_levels[BIKE_BLOG_CAT_CAN_RAW], LOG_LEVEL_ALL, LOG_LEVEL_NONE),
+            ConfigInt("mcp", &blog_levels[BIKE_BLOG_CAT_MCP], LOG_LEVEL_ALL, LOG_LEVEL_NONE)
+        }),
+        ConfigObject("ts", {
+            ConfigBool("enable", &enable_ts),
+            ConfigInt("rate", &ts_sample_ms, 100, 10000),
+            ConfigFloat("sp", &ts_speed_error_kmph, 0.0, 10.0),
+            ConfigInt("flush", &ts_flush_s, 10, 600)
+        }),
+        ConfigObject("deadband", {
+            ConfigFloat("sp", &deadband_speed_kmph, 0.0, 50.0),
+            ConfigInt("bt", &deadband_battery_pct, 0, 100),
+            ConfigInt("odo", &deadband_odometer_m, 0, 100000),
+            ConfigInt("pas", &deadband_pas, 0, 10),
+            ConfigInt("key", &keyframe_interval, 1, 1000)
+        })
     });
     ConfigService::instance().registerModule(bikeConfigDesc);
 
@@ -36,8 +72,19 @@ void BikeConfig::loop() {
 }
 
 void BikeConfig::logSettings() {
-    Log.info("Settings: {idleTimeout=%li, publishTriggerSpeed=%0.2f kmph, UDREnable=%s}", 
-        can_idle_timeout_s, publish_trigger_speed_kmph, enable_udr ? "true" : "false");
+    Log.info("Settings: {idleTimeout=%li, publishTriggerSpeed=%0.2f kmph, publishDistance=%li m, UDREnable=%s, CANHwFilter=%s, CANStatsLoc=%s, CANWakeTriage=%li ms, CANMissPeriods=%li}", 
+        can_idle_timeout_s, publish_trigger_speed_kmph, publish_distance_m, enable_udr ? "true" : "false", enable_can_hw_filter ? "true" : "false",
+        enable_can_stats_publish ? "true" : "false", can_wake_triage_ms, can_miss_periods);
+    Log.info("Max field age (ms): {pas=%li, sp=%li, cap=%li, bt=%li, odo=%li, tsf=%li}",
+        max_field_age_ms[BIKE_DATA_PAS_LEVEL], max_field_age_ms[BIKE_DATA_SPEED], max_field_age_ms[BIKE_DATA_BATTERY_CAPACITY],
+        max_field_age_ms[BIKE_DATA_BATTERY_PCT], max_field_age_ms[BIKE_DATA_ODOMETER], max_field_age_ms[BIKE_DATA_BATTERY_TIME_SINCE_FULL]);
+    Log.info("CAN sniff: {interval=%li ms, window=%li ms}", sniff_interval_ms, sniff_window_ms);
+    Log.info("Binary log: {sink=%s, can=%li, raw=%li, mcp=%li}", (blog_sink == BIKE_BLOG_SINK_FLASH) ? "flash" : "serial",
+        blog_levels[BIKE_BLOG_CAT_CAN], blog_levels[BIKE_BLOG_CAT_CAN_RAW], blog_levels[BIKE_BLOG_CAT_MCP]);
+    Log.info("Ride time series: {enable=%s, rate=%li ms, sp=%0.2f kmph, flush=%li s}", enable_ts ? "true" : "false",
+        ts_sample_ms, ts_speed_error_kmph, ts_flush_s);
+    Log.info("Deadbands: {sp=%0.2f kmph, bt=%li%%, odo=%li m, pas=%li, keyframe=%li}",
+        deadband_speed_kmph, deadband_battery_pct, deadband_odometer_m, deadband_pas, keyframe_interval);
 } 
 
 // static 
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "Particle.h"
+#include "bike_canbus.h"
+#include "bike_blog.h"
 
 class BikeConfig {
 public:
@@ -11,7 +13,26 @@ public:
 
     int32_t getIdleTimeout() const { return can_idle_timeout_s; };
     double getPublishTriggerSpeed() const { return publish_trigger_speed_kmph; };
+    int32_t getPublishDistance() const { return publish_distance_m; };
     bool getUDREnable() const { return enable_udr; };
+    bool getCANHwFilterEnable() const { return enable_can_hw_filter; };
+    bool getCANStatsPublishEnable() const { return enable_can_stats_publish; };
+    int32_t getMaxFieldAgeMs(bike_data_field_t field) const { return max_field_age_ms[field]; };
+    double getSpeedDeadband() const { return deadband_speed_kmph; };
+    int32_t getBatteryDeadband() const { return deadband_battery_pct; };
+    int32_t getOdometerDeadband() const { return deadband_odometer_m; };
+    int32_t getPASDeadband() const { return deadband_pas; };
+    int32_t getKeyframeInterval() const { return keyframe_interval; };
+    int32_t getWakeTriageMs() const { return can_wake_triage_ms; };
+    int32_t getCANMissPeriods() const { return can_miss_periods; };
+    int32_t getBinLogLevel(bike_blog_cat_t category) const { return blog_levels[category]; };
+    int32_t getBinLogSink() const { return blog_sink; };
+    int32_t getSniffIntervalMs() const { return sniff_interval_ms; };
+    int32_t getSniffWindowMs() const { return sniff_window_ms; };
+    bool getTelemetryEnable() const { return enable_ts; };
+    int32_t getTelemetrySampleMs() const { return ts_sample_ms; };
+    double getTelemetrySpeedError() const { return ts_speed_error_kmph; };
+    int32_t getTelemetryFlushS() const { return ts_flush_s; };
 
     static BikeConfig &instance();
 
@@ -21,7 +42,50 @@ protected:
 
     int32_t can_idle_timeout_s = 60;
     double publish_trigger_speed_kmph = 8.0;
+    int32_t publish_distance_m = 0;     // Publish every this many odometer meters instead of on speed, 0 uses speed
     bool enable_udr = true;
+    bool enable_can_hw_filter = true;
+    bool enable_can_stats_publish = false;
+
+    // Oldest a bike_data_t field may be before it is left out of publishes, indexed by bike_data_field_t
+    int32_t max_field_age_ms[BIKE_DATA_NUM_FIELDS] = {
+        5000,       // pas_level
+        3000,       // speed
+        60000,      // battery_capacity
+        60000,      // battery_pct
+        60000,      // odometer
+        120000,     // battery_time_since_full
+    };
+
+    // Minimum change since the last published value before a field is sent again
+    double deadband_speed_kmph = 1.0;
+    int32_t deadband_battery_pct = 1;
+    int32_t deadband_odometer_m = 50;
+    int32_t deadband_pas = 1;
+    int32_t keyframe_interval = 10;     // Every Nth loc publish carries all fields
+
+    int32_t can_wake_triage_ms = 3000;  // 0 brings up the network on every CAN wake
+    int32_t can_miss_periods = 5;       // Missed heartbeat frames before the bus counts as idle, 0 uses the fixed timeout
+
+    // Instead of waking on any bus activity, look for ride-start frames for sniff_window_ms every
+    // sniff_interval_ms while asleep. 0 wakes on bus activity.
+    int32_t sniff_interval_ms = 0;
+    int32_t sniff_window_ms = 200;
+
+    // Binary log level (LogLevel value) per bike_blog_cat_t, and where records are drained to
+    int32_t blog_levels[BIKE_BLOG_NUM_CATS] = {
+        LOG_LEVEL_INFO,     // can
+        LOG_LEVEL_INFO,     // raw, LOG_LEVEL_TRACE records every frame
+        LOG_LEVEL_INFO,     // mcp
+    };
+    int32_t blog_sink = BIKE_BLOG_SINK_SERIAL;
+
+    // Compressed "ride_ts" time series: sample rate, how far the published speed may stray from
+    // the samples, and the longest a batch is held
+    bool enable_ts = true;
+    int32_t ts_sample_ms = 500;
+    double ts_speed_error_kmph = 0.5;
+    int32_t ts_flush_s = 60;
 
     static BikeConfig *_instance;
 };
\ No newline at end of file
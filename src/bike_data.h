@@ -0,0 +1,36 @@
+// Decoded bike data and received CAN frames
+//
+// Plain types only, with no Device OS dependencies, so host-side tools can use them as well.
+#pragma once
+
+#include <stdint.h>
+
+// Index of each bike_data_t field in updated_ms[] and in the staleness mask
+typedef enum : uint8_t {
+    BIKE_DATA_PAS_LEVEL,
+    BIKE_DATA_SPEED,
+    BIKE_DATA_BATTERY_CAPACITY,
+    BIKE_DATA_BATTERY_PCT,
+    BIKE_DATA_ODOMETER,
+    BIKE_DATA_BATTERY_TIME_SINCE_FULL,
+    BIKE_DATA_NUM_FIELDS
+} bike_data_field_t;
+
+#define BIKE_DATA_FIELD_MASK(field)     (1UL << (field))
+
+typedef struct {
+    uint8_t pas_level;
+    float speed;
+    float battery_capacity;
+    uint8_t battery_pct;
+    uint32_t odometer;
+    uint32_t battery_time_since_full;
+    long unsigned int updated_ms[BIKE_DATA_NUM_FIELDS];    // rxTimeMs of the frame that last set each field, 0 if never set
+} bike_data_t;
+
+typedef struct {
+    long unsigned int rxId;
+    unsigned char len;
+    unsigned char rxBuf[8];
+    long unsigned int rxTimeMs;     // millis() when the frame was read out of the MCP
+} can_frame_t;
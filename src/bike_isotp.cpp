@@ -0,0 +1,243 @@
+#include "Particle.h"
+#include "bike_isotp.h"
+
+Logger bike_isotp("app.bike_can.isotp");
+
+// Protocol control information, high nibble of the first byte
+#define ISOTP_PCI_SF                    (0x00)
+#define ISOTP_PCI_FF                    (0x10)
+#define ISOTP_PCI_CF                    (0x20)
+#define ISOTP_PCI_FC                    (0x30)
+#define ISOTP_FC_CTS                    (0x00)
+#define ISOTP_FC_WAIT                   (0x01)
+#define ISOTP_FC_OVERFLOW               (0x02)
+#define ISOTP_SF_MAX                    (7)
+#define ISOTP_FF_DATA                   (6)
+#define ISOTP_CF_DATA                   (7)
+
+BikeISOTP::BikeISOTP() :
+    _state(STATE_IDLE),
+    _tx_id(0),
+    _rx_id(0),
+    _callback(nullptr),
+    _deadline_ms(0),
+    _tx_len(0),
+    _tx_pos(0),
+    _tx_sn(0),
+    _tx_block_left(0),
+    _tx_block_limited(false),
+    _tx_stmin_ms(0),
+    _tx_next_ms(0),
+    _rx_len(0),
+    _rx_pos(0),
+    _rx_sn(0),
+    _rx_again(false)
+{
+}
+
+int BikeISOTP::request(uint16_t tx_id, uint16_t rx_id, const uint8_t *data, size_t len, BikeISOTPCallback callback) {
+    if (_state != STATE_IDLE) {
+        return SYSTEM_ERROR_BUSY;
+    }
+    if (len == 0 || len > BIKE_ISOTP_MAX_PAYLOAD) {
+        return SYSTEM_ERROR_INVALID_ARGUMENT;
+    }
+
+    _tx_id = tx_id;
+    _rx_id = rx_id;
+    _callback = callback;
+    memcpy(_tx_buf, data, len);
+    _tx_len = len;
+
+    if (len <= ISOTP_SF_MAX) {
+        uint8_t pci = ISOTP_PCI_SF | (uint8_t)len;
+        if (!sendFrame(&pci, 1, _tx_buf, len)) {
+            return SYSTEM_ERROR_INTERNAL;
+        }
+        _state = STATE_RX_WAIT;
+        _deadline_ms = millis() + BIKE_ISOTP_RESPONSE_TIMEOUT_MS;
+        return SYSTEM_ERROR_NONE;
+    }
+
+    uint8_t pci[2] = { (uint8_t)(ISOTP_PCI_FF | ((len >> 8) & 0x0F)), (uint8_t)(len & 0xFF) };
+    if (!sendFrame(pci, sizeof(pci), _tx_buf, ISOTP_FF_DATA)) {
+        return SYSTEM_ERROR_INTERNAL;
+    }
+    _tx_pos = ISOTP_FF_DATA;
+    _tx_sn = 1;
+    _state = STATE_TX_WAIT_FC;
+    _deadline_ms = millis() + BIKE_ISOTP_TIMEOUT_MS;
+    return SYSTEM_ERROR_NONE;
+}
+
+void BikeISOTP::awaitResponse(uint32_t timeout_ms) {
+    _rx_again = true;
+    _deadline_ms = millis() + timeout_ms;
+}
+
+bool BikeISOTP::processFrame(const can_frame_t &frame) {
+    if (_state == STATE_IDLE || frame.rxId != _rx_id || frame.len == 0) {
+        return false;
+    }
+
+    const uint8_t *buf = frame.rxBuf;
+    uint8_t type = buf[0] & 0xF0;
+
+    switch (_state) {
+        case STATE_TX_WAIT_FC: {
+            if (type != ISOTP_PCI_FC || frame.len < 3) {
+                break;
+            }
+            uint8_t status = buf[0] & 0x0F;
+            if (status == ISOTP_FC_WAIT) {
+                _deadline_ms = millis() + BIKE_ISOTP_TIMEOUT_MS;
+            } else if (status == ISOTP_FC_OVERFLOW) {
+                finish(BIKE_ISOTP_OVERFLOW);
+            } else if (status == ISOTP_FC_CTS) {
+                _tx_block_left = buf[1];
+                _tx_block_limited = (buf[1] != 0);
+                // 0x00-0x7F are milliseconds; the 100-900 us codes are rounded up to 1 ms
+                _tx_stmin_ms = (buf[2] <= 0x7F) ? buf[2] : 1;
+                _tx_next_ms = millis();
+                _deadline_ms = _tx_next_ms + BIKE_ISOTP_TIMEOUT_MS;
+                _state = STATE_TX_CF;
+            }
+            break;
+        }
+
+        case STATE_RX_WAIT: {
+            if (type == ISOTP_PCI_SF) {
+                size_t len = buf[0] & 0x0F;
+                if (len == 0 || len > (size_t)(frame.len - 1)) {
+                    break;
+                }
+                finish(BIKE_ISOTP_OK, &buf[1], len);
+            } else if (type == ISOTP_PCI_FF && frame.len == 8) {
+                _rx_len = ((size_t)(buf[0] & 0x0F) << 8) | buf[1];
+                if (_rx_len > BIKE_ISOTP_MAX_PAYLOAD) {
+                    sendFlowControl(ISOTP_FC_OVERFLOW);
+                    finish(BIKE_ISOTP_OVERFLOW);
+                    break;
+                }
+                memcpy(_rx_buf, &buf[2], ISOTP_FF_DATA);
+                _rx_pos = ISOTP_FF_DATA;
+                _rx_sn = 1;
+                _state = STATE_RX_CF;
+                _deadline_ms = millis() + BIKE_ISOTP_TIMEOUT_MS;
+                sendFlowControl(ISOTP_FC_CTS);
+            }
+            break;
+        }
+
+        case STATE_RX_CF: {
+            if (type != ISOTP_PCI_CF) {
+                break;
+            }
+            if ((buf[0] & 0x0F) != _rx_sn) {
+                finish(BIKE_ISOTP_SEQUENCE);
+                break;
+            }
+            size_t chunk = _rx_len - _rx_pos;
+            if (chunk > ISOTP_CF_DATA) {
+                chunk = ISOTP_CF_DATA;
+            }
+            if (chunk > (size_t)(frame.len - 1)) {
+                chunk = frame.len - 1;
+            }
+            memcpy(&_rx_buf[_rx_pos], &buf[1], chunk);
+            _rx_pos += chunk;
+            _rx_sn = (_rx_sn + 1) & 0x0F;
+            _deadline_ms = millis() + BIKE_ISOTP_TIMEOUT_MS;
+            if (_rx_pos >= _rx_len) {
+                finish(BIKE_ISOTP_OK, _rx_buf, _rx_len);
+            }
+            break;
+        }
+
+        default:
+            return false;
+    }
+    return true;
+}
+
+void BikeISOTP::loop() {
+    if (_state == STATE_IDLE) {
+        return;
+    }
+
+    long unsigned int now = millis();
+    if (_state == STATE_TX_CF) {
+        if ((long)(now - _tx_next_ms) < 0) {
+            return;
+        }
+        if (!sendConsecutiveFrame()) {
+            // The transmit queue may just be full; try again until the peer would give up on us
+            if ((long)(now - _deadline_ms) >= 0) {
+                finish(BIKE_ISOTP_TX_ERROR);
+            }
+            return;
+        }
+        _tx_next_ms = now + _tx_stmin_ms;
+        _deadline_ms = now + BIKE_ISOTP_TIMEOUT_MS;
+
+        if (_tx_pos >= _tx_len) {
+            _state = STATE_RX_WAIT;
+            _deadline_ms = now + BIKE_ISOTP_RESPONSE_TIMEOUT_MS;
+        } else if (_tx_block_limited && --_tx_block_left == 0) {
+            _state = STATE_TX_WAIT_FC;
+            _deadline_ms = now + BIKE_ISOTP_TIMEOUT_MS;
+        }
+        return;
+    }
+
+    if ((long)(now - _deadline_ms) >= 0) {
+        bike_isotp.warn("0x%03X timed out (state %u)", _tx_id, _state);
+        finish(BIKE_ISOTP_TIMEOUT);
+    }
+}
+
+bool BikeISOTP::sendFrame(const uint8_t *pci, size_t pci_len, const uint8_t *data, size_t len) {
+    uint8_t frame[8];
+    memset(frame, BIKE_ISOTP_PAD_BYTE, sizeof(frame));
+    memcpy(frame, pci, pci_len);
+    if (len) {
+        memcpy(&frame[pci_len], data, len);
+    }
+    return BikeCANBus::instance().queueTransmit(_tx_id, sizeof(frame), frame) == SYSTEM_ERROR_NONE;
+}
+
+bool BikeISOTP::sendConsecutiveFrame() {
+    size_t chunk = _tx_len - _tx_pos;
+    if (chunk > ISOTP_CF_DATA) {
+        chunk = ISOTP_CF_DATA;
+    }
+    uint8_t pci = ISOTP_PCI_CF | _tx_sn;
+    if (!sendFrame(&pci, 1, &_tx_buf[_tx_pos], chunk)) {
+        return false;
+    }
+    _tx_pos += chunk;
+    _tx_sn = (_tx_sn + 1) & 0x0F;
+    return true;
+}
+
+void BikeISOTP::sendFlowControl(uint8_t status) {
+    uint8_t pci[3] = { (uint8_t)(ISOTP_PCI_FC | status), BIKE_ISOTP_RX_BLOCK_SIZE, BIKE_ISOTP_RX_STMIN_MS };
+    sendFrame(pci, sizeof(pci), nullptr, 0);
+}
+
+// The callback may start the next exchange, or call awaitResponse() to keep this one open
+void BikeISOTP::finish(bike_isotp_result_t result, const uint8_t *data, size_t len) {
+    BikeISOTPCallback callback = _callback;
+    _state = STATE_IDLE;
+    _rx_again = false;
+
+    if (callback) {
+        callback(result, data, len);
+    }
+
+    if (_rx_again) {
+        _rx_again = false;
+        _callback = callback;
+        _state = STATE_RX_WAIT;
+    }
+}
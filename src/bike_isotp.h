@@ -0,0 +1,86 @@
+// ISO-TP (ISO 15765-2) transport over BikeCANBus
+//
+// One request/response exchange at a time with normal 11-bit addressing: the request is sent as a
+// single frame, or as a first frame plus consecutive frames paced by the peer's flow control, and
+// the response is reassembled into a fixed buffer, answering its first frame with flow control.
+// Nothing blocks; frames come in through processFrame() and timers run from loop(), both on the
+// application thread.
+#pragma once
+
+#include "Particle.h"
+#include "bike_canbus.h"
+
+#define BIKE_ISOTP_MAX_PAYLOAD          (128)   // Largest request or response, bytes
+#define BIKE_ISOTP_TIMEOUT_MS           (1000)  // N_Bs/N_Cr: flow control or next consecutive frame
+#define BIKE_ISOTP_RESPONSE_TIMEOUT_MS  (1000)  // Request sent to start of the response
+#define BIKE_ISOTP_RX_BLOCK_SIZE        (0)     // Flow control we send: no further flow control...
+#define BIKE_ISOTP_RX_STMIN_MS          (0)     // ...and no gap between consecutive frames
+#define BIKE_ISOTP_PAD_BYTE             (0xAA)  // Fills frames out to 8 bytes
+
+typedef enum {
+    BIKE_ISOTP_OK,
+    BIKE_ISOTP_TIMEOUT,             // No flow control, consecutive frame or response in time
+    BIKE_ISOTP_OVERFLOW,            // Response longer than BIKE_ISOTP_MAX_PAYLOAD, or the peer said overflow
+    BIKE_ISOTP_SEQUENCE,            // Consecutive frame out of order
+    BIKE_ISOTP_TX_ERROR,            // A frame could not be queued or sent
+} bike_isotp_result_t;
+
+// data/len hold the response on BIKE_ISOTP_OK; the buffer is only valid during the call
+using BikeISOTPCallback = std::function<void(bike_isotp_result_t result, const uint8_t *data, size_t len)>;
+
+class BikeISOTP {
+    public:
+        BikeISOTP();
+
+        // Send data to tx_id and collect the response from rx_id. Returns SYSTEM_ERROR_BUSY while an
+        // exchange is in progress.
+        int request(uint16_t tx_id, uint16_t rx_id, const uint8_t *data, size_t len, BikeISOTPCallback callback);
+
+        // Keep waiting for another response on the current exchange, for a peer that answered
+        // "response pending". Only valid from inside the callback.
+        void awaitResponse(uint32_t timeout_ms);
+
+        // Feed every received frame. Returns true if it belonged to the current exchange.
+        bool processFrame(const can_frame_t &frame);
+
+        void loop();
+
+        inline bool isBusy() {
+            return _state != STATE_IDLE;
+        }
+
+    private:
+        typedef enum {
+            STATE_IDLE,
+            STATE_TX_WAIT_FC,           // First frame sent, waiting for the peer's flow control
+            STATE_TX_CF,                // Sending consecutive frames
+            STATE_RX_WAIT,              // Request sent, waiting for a single or first frame
+            STATE_RX_CF,                // Receiving consecutive frames
+        } state_t;
+
+        state_t _state;
+        uint16_t _tx_id;
+        uint16_t _rx_id;
+        BikeISOTPCallback _callback;
+        long unsigned int _deadline_ms;
+
+        uint8_t _tx_buf[BIKE_ISOTP_MAX_PAYLOAD];
+        size_t _tx_len;
+        size_t _tx_pos;
+        uint8_t _tx_sn;
+        uint8_t _tx_block_left;         // Consecutive frames left in this block, 0 for unlimited
+        bool _tx_block_limited;
+        uint8_t _tx_stmin_ms;
+        long unsigned int _tx_next_ms;
+
+        uint8_t _rx_buf[BIKE_ISOTP_MAX_PAYLOAD];
+        size_t _rx_len;                 // Length announced by the first frame
+        size_t _rx_pos;
+        uint8_t _rx_sn;
+        bool _rx_again;                 // awaitResponse() was called from the callback
+
+        bool sendFrame(const uint8_t *pci, size_t pci_len, const uint8_t *data, size_t len);
+        bool sendConsecutiveFrame();
+        void sendFlowControl(uint8_t status);
+        void finish(bike_isotp_result_t result, const uint8_t *data = nullptr, size_t len = 0);
+};
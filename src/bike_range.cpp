@@ -0,0 +1,167 @@
+#include "Particle.h"
+#include "bike_range.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+
+BikeRange *BikeRange::_instance = nullptr;
+
+Logger bike_range("app.bike_range");
+
+// Starting point per assist level until the bike taught us better
+const float BikeRange::default_whkm[BIKE_RANGE_PAS_LEVELS] = { 1.0f, 5.0f, 7.0f, 9.0f, 12.0f, 15.0f };
+
+typedef struct {
+    uint32_t magic;
+    bike_range_table_t table;
+} bike_range_file_t;
+
+#define BIKE_RANGE_MAGIC                (0x42524731)    // "BRG1"
+
+void BikeRange::setup() {
+    int fd = open(BIKE_RANGE_FILE, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    bike_range_file_t file;
+    bool ok = (read(fd, &file, sizeof(file)) == sizeof(file)) && file.magic == BIKE_RANGE_MAGIC;
+    close(fd);
+
+    if (!ok) {
+        bike_range.warn("Ignoring invalid %s", BIKE_RANGE_FILE);
+        return;
+    }
+    for (size_t i = 0; i < BIKE_RANGE_PAS_LEVELS; i++) {
+        if (!(file.table.whkm[i] >= BIKE_RANGE_MIN_WHKM && file.table.whkm[i] <= BIKE_RANGE_MAX_WHKM) || !(file.table.km[i] >= 0.0f)) {
+            bike_range.warn("Ignoring out of range table in %s", BIKE_RANGE_FILE);
+            return;
+        }
+    }
+    _table = file.table;
+    bike_range.info("Loaded Wh/km {%.1f, %.1f, %.1f, %.1f, %.1f, %.1f}", _table.whkm[0], _table.whkm[1], _table.whkm[2],
+        _table.whkm[3], _table.whkm[4], _table.whkm[5]);
+}
+
+void BikeRange::save() {
+    if (!_dirty) {
+        return;
+    }
+
+    bike_range_file_t file = { BIKE_RANGE_MAGIC, _table };
+    int fd = open(BIKE_RANGE_FILE, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0 || write(fd, &file, sizeof(file)) != sizeof(file)) {
+        bike_range.error("Unable to save range table to %s", BIKE_RANGE_FILE);
+    } else {
+        _dirty = false;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void BikeRange::anchor(const bike_data_t &data) {
+    _anchored = true;
+    _pct = data.battery_pct;
+    _odometer = data.odometer;
+    memset(_dist_m, 0, sizeof(_dist_m));
+}
+
+void BikeRange::update(const bike_data_t &data) {
+    uint32_t stale = BikeCANBus::getStaleFields(data, millis());
+    if (BikeCANBus::isFieldStale(stale, BIKE_DATA_BATTERY_PCT) || BikeCANBus::isFieldStale(stale, BIKE_DATA_ODOMETER) ||
+        BikeCANBus::isFieldStale(stale, BIKE_DATA_PAS_LEVEL)) {
+        // Distance we cannot attribute would skew the next drop
+        _anchored = false;
+        _aligned = false;
+        return;
+    }
+
+    if (!_anchored) {
+        anchor(data);
+        return;
+    }
+
+    if (data.odometer < _odometer || data.odometer - _odometer > BIKE_RANGE_MAX_STEP_M || data.battery_pct > _pct) {
+        // Odometer glitch, a gap we did not see, or charging
+        _aligned = false;
+        anchor(data);
+        return;
+    }
+
+    uint8_t level = (data.pas_level < BIKE_RANGE_PAS_LEVELS) ? data.pas_level : BIKE_RANGE_PAS_LEVELS - 1;
+    _dist_m[level] += data.odometer - _odometer;
+    _odometer = data.odometer;
+
+    if (data.battery_pct < _pct) {
+        // The first drop after anchoring covers an unknown part of a percent
+        if (_aligned) {
+            learn(_pct - data.battery_pct, packWh(data, stale));
+        }
+        _aligned = true;
+        anchor(data);
+    }
+}
+
+void BikeRange::learn(uint8_t drop, float pack_wh) {
+    uint32_t total_m = 0;
+    float predicted_wh = 0.0f;
+    for (size_t i = 0; i < BIKE_RANGE_PAS_LEVELS; i++) {
+        total_m += _dist_m[i];
+        predicted_wh += (float)_dist_m[i] / 1000.0f * _table.whkm[i];
+    }
+    if (total_m < BIKE_RANGE_MIN_SEGMENT_M * drop || predicted_wh <= 0.0f) {
+        return;
+    }
+
+    // Scale every level ridden by how far off the prediction was for the stretch as a whole
+    float scale = (float)drop / 100.0f * pack_wh / predicted_wh;
+    for (size_t i = 0; i < BIKE_RANGE_PAS_LEVELS; i++) {
+        if (!_dist_m[i]) {
+            continue;
+        }
+        float km = (float)_dist_m[i] / 1000.0f;
+        float observed = fminf(fmaxf(_table.whkm[i] * scale, BIKE_RANGE_MIN_WHKM), BIKE_RANGE_MAX_WHKM);
+        float alpha = (km < BIKE_RANGE_HORIZON_KM) ? km / BIKE_RANGE_HORIZON_KM : 1.0f;
+        _table.whkm[i] += alpha * (observed - _table.whkm[i]);
+        _table.km[i] += km;
+    }
+
+    float total_km = 0.0f;
+    for (size_t i = 0; i < BIKE_RANGE_PAS_LEVELS; i++) {
+        total_km += _table.km[i];
+    }
+    if (total_km > BIKE_RANGE_MIX_KM) {
+        for (size_t i = 0; i < BIKE_RANGE_PAS_LEVELS; i++) {
+            _table.km[i] /= 2.0f;
+        }
+    }
+    _dirty = true;
+
+    bike_range.trace("%u%% over %lu m: scale %.2f", drop, total_m, scale);
+}
+
+// Consumption of the rider's usual mix of assist levels
+float BikeRange::mixWhkm() {
+    float km = 0.0f;
+    float wh = 0.0f;
+    for (size_t i = 0; i < BIKE_RANGE_PAS_LEVELS; i++) {
+        km += _table.km[i];
+        wh += _table.km[i] * _table.whkm[i];
+    }
+    return (km >= 1.0f) ? wh / km : _table.whkm[BIKE_RANGE_DEFAULT_LEVEL];
+}
+
+float BikeRange::packWh(const bike_data_t &data, uint32_t stale) {
+    if (BikeCANBus::isFieldStale(stale, BIKE_DATA_BATTERY_CAPACITY) || data.battery_capacity <= 0.0f) {
+        return BIKE_RANGE_DEFAULT_WH;
+    }
+    return data.battery_capacity * BIKE_RANGE_NOMINAL_V;
+}
+
+float BikeRange::getRangeKm(const bike_data_t &data, uint32_t stale) {
+    if (BikeCANBus::isFieldStale(stale, BIKE_DATA_BATTERY_PCT)) {
+        return -1.0f;
+    }
+    return (float)data.battery_pct / 100.0f * packWh(data, stale) / mixWhkm();
+}
@@ -0,0 +1,81 @@
+// Remaining range prediction, learned from how fast the battery drains at each assist level
+//
+// Between two steps of the battery percentage, the odometer distance ridden is split by assist
+// level. When the percentage drops, the energy of the drop is shared out over the levels in
+// proportion to what the current table predicts for them, and each level's Wh/km is pulled
+// towards its share by a weight that grows with the distance ridden at that level. The remaining
+// energy divided by the Wh/km of the rider's usual mix of levels gives the range. Every update
+// is a fixed amount of work over the few assist levels; the table is saved to flash when a ride
+// ends.
+#pragma once
+
+#include "Particle.h"
+#include "bike_canbus.h"
+
+#define BIKE_RANGE_PAS_LEVELS           (6)         // Assist levels learned; higher levels count as the last
+#define BIKE_RANGE_DEFAULT_LEVEL        (2)         // Level the prediction uses before any distance was ridden
+#define BIKE_RANGE_NOMINAL_V            (36.0f)     // Pack voltage, battery_capacity is in Ah
+#define BIKE_RANGE_DEFAULT_WH           (500.0f)    // Pack energy when the capacity was not received
+#define BIKE_RANGE_HORIZON_KM           (20.0f)     // Distance over which a level's Wh/km mostly follows new data
+#define BIKE_RANGE_MIX_KM               (500.0f)    // Level mix history is halved past this total
+#define BIKE_RANGE_MIN_SEGMENT_M        (200)       // Shorter stretches per percent are left out
+#define BIKE_RANGE_MAX_STEP_M           (1000)      // Larger odometer jumps between updates start over
+#define BIKE_RANGE_MIN_WHKM             (0.5f)
+#define BIKE_RANGE_MAX_WHKM             (60.0f)
+#define BIKE_RANGE_FILE                 "/usr/bike_range"
+
+typedef struct {
+    float whkm[BIKE_RANGE_PAS_LEVELS];  // Learned consumption per level
+    float km[BIKE_RANGE_PAS_LEVELS];    // Distance ridden per level, decayed, for the usual mix
+} bike_range_table_t;
+
+class BikeRange {
+    public:
+        static BikeRange &instance()
+        {
+            if(!_instance)
+            {
+                _instance = new BikeRange();
+            }
+            return *_instance;
+        }
+
+        void setup();
+
+        // Fold in the decoder's data; call whenever new data was decoded
+        void update(const bike_data_t &data);
+
+        // Write the table to flash if it changed, at the end of a ride
+        void save();
+
+        // Predicted remaining km, or a negative value when the battery level is stale
+        float getRangeKm(const bike_data_t &data, uint32_t stale);
+
+    private:
+        BikeRange() : _anchored(false), _aligned(false), _pct(0), _odometer(0), _dirty(false) {
+            for (size_t i = 0; i < BIKE_RANGE_PAS_LEVELS; i++) {
+                _table.whkm[i] = default_whkm[i];
+                _table.km[i] = 0.0f;
+            }
+            memset(_dist_m, 0, sizeof(_dist_m));
+        };
+
+        static BikeRange *_instance;
+        static const float default_whkm[BIKE_RANGE_PAS_LEVELS];
+
+        bike_range_table_t _table;
+
+        // Current stretch of one battery percent
+        bool _anchored;
+        bool _aligned;                  // The stretch started on a percent step, not part way through one
+        uint8_t _pct;
+        uint32_t _odometer;
+        uint32_t _dist_m[BIKE_RANGE_PAS_LEVELS];
+
+        bool _dirty;
+
+        void anchor(const bike_data_t &data);
+        void learn(uint8_t drop, float pack_wh);
+        float mixWhkm();
+        static float packWh(const bike_data_t &data, uint32_t stale);
+};
@@ -0,0 +1,222 @@
+#include "Particle.h"
+#include "bike_ride.h"
+#include "location_service.h"
+
+#include <math.h>
+
+BikeRide *BikeRide::_instance = nullptr;
+
+Logger bike_ride("app.bike_ride");
+
+#define EARTH_RADIUS_M                  (6371000.0)
+
+static double distanceM(double lat1, double lon1, double lat2, double lon2) {
+    double dlat = (lat2 - lat1) * M_PI / 180.0;
+    double dlon = (lon2 - lon1) * M_PI / 180.0;
+    double a = sin(dlat / 2) * sin(dlat / 2) +
+        cos(lat1 * M_PI / 180.0) * cos(lat2 * M_PI / 180.0) * sin(dlon / 2) * sin(dlon / 2);
+    return 2.0 * EARTH_RADIUS_M * atan2(sqrt(a), sqrt(1.0 - a));
+}
+
+void BikeRide::setup() {
+    if (_queue.start(BIKE_RIDE_QUEUE_FILE, BIKE_RIDE_QUEUE_SIZE, DiskQueuePolicy::FifoDeleteOld) != SYSTEM_ERROR_NONE) {
+        bike_ride.error("Failed to start ride disk queue");
+    }
+}
+
+void BikeRide::loop() {
+    if (_riding) {
+        updateGNSS();
+    }
+    publishNext();
+}
+
+void BikeRide::start() {
+    if (_riding) {
+        return;
+    }
+
+    memset(&_stats, 0, sizeof(_stats));
+    _stats.start_ms = millis();
+    _stats.start_time = Time.isValid() ? Time.now() : 0;
+    _last_sample_ms = _stats.start_ms;
+    _have_speed = false;
+    _have_pas = false;
+    _have_fix = false;
+    _riding = true;
+
+    bike_ride.info("Ride started");
+}
+
+void BikeRide::end() {
+    if (!_riding) {
+        return;
+    }
+
+    // The ride ended with the last data, not when inactivity was declared, so the time since is
+    // not integrated
+    _riding = false;
+    _stats.duration_ms = _last_sample_ms - _stats.start_ms;
+
+    bool moved = (_stats.have_odometer && _stats.odometer_end > _stats.odometer_start) || _stats.gnss_distance_m >= 1.0;
+    if (_stats.duration_ms < BIKE_RIDE_MIN_MS && !moved) {
+        bike_ride.info("Ride too short to report (%lu ms)", _stats.duration_ms);
+        return;
+    }
+
+    static char buf[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+    writeSummary(buf, sizeof(buf));
+    bike_ride.info("Ride ended: %s", buf);
+
+    if (!_queue.pushBack(String(buf))) {
+        bike_ride.warn("Unable to write ride summary to DiskQueue, discarding");
+    }
+}
+
+// Credit the time since the last sample to the speed and assist level that held during it
+void BikeRide::integrate(long unsigned int now_ms) {
+    long unsigned int dt = now_ms - _last_sample_ms;
+    _last_sample_ms = now_ms;
+    if (dt > BIKE_RIDE_MAX_GAP_MS) {
+        return;
+    }
+
+    if (_have_speed) {
+        _stats.speed_time += (double)_last_speed * (double)dt;
+        _stats.speed_ms += dt;
+        if (_last_speed >= BIKE_RIDE_MOVING_KMPH) {
+            _stats.moving_ms += dt;
+        }
+    }
+    if (_have_pas) {
+        uint8_t level = (_last_pas < BIKE_RIDE_PAS_LEVELS) ? _last_pas : BIKE_RIDE_PAS_LEVELS - 1;
+        _stats.pas_ms[level] += dt;
+    }
+}
+
+void BikeRide::update(const bike_data_t &data) {
+    if (!_riding) {
+        return;
+    }
+
+    long unsigned int now = millis();
+    integrate(now);
+
+    uint32_t stale = BikeCANBus::getStaleFields(data, now);
+    _have_speed = !BikeCANBus::isFieldStale(stale, BIKE_DATA_SPEED);
+    _have_pas = !BikeCANBus::isFieldStale(stale, BIKE_DATA_PAS_LEVEL);
+    _last_speed = data.speed;
+    _last_pas = data.pas_level;
+
+    if (_have_speed && data.speed > _stats.speed_max) {
+        _stats.speed_max = data.speed;
+    }
+
+    if (!BikeCANBus::isFieldStale(stale, BIKE_DATA_ODOMETER)) {
+        if (!_stats.have_odometer || data.odometer < _stats.odometer_start) {
+            _stats.have_odometer = true;
+            _stats.odometer_start = data.odometer;
+        }
+        _stats.odometer_end = data.odometer;
+    }
+
+    if (!BikeCANBus::isFieldStale(stale, BIKE_DATA_BATTERY_PCT)) {
+        if (!_stats.have_battery) {
+            _stats.have_battery = true;
+            _stats.battery_start = data.battery_pct;
+        }
+        _stats.battery_end = data.battery_pct;
+    }
+}
+
+void BikeRide::updateGNSS() {
+    long unsigned int now = millis();
+    if (now - _last_gnss_poll_ms < BIKE_RIDE_GNSS_POLL_MS) {
+        return;
+    }
+    _last_gnss_poll_ms = now;
+
+    LocationPoint point;
+    if (LocationService::instance().getLocation(point) != SYSTEM_ERROR_NONE || !point.locked ||
+        point.horizontalAccuracy > BIKE_RIDE_GNSS_MAX_ACCURACY_M) {
+        return;
+    }
+
+    if (_have_fix) {
+        double d = distanceM(_last_lat, _last_lon, point.latitude, point.longitude);
+        // Movement within the fix accuracy is noise; keep the old point so slow progress still adds up
+        if (d < point.horizontalAccuracy) {
+            return;
+        }
+        _stats.gnss_distance_m += d;
+    }
+    _last_lat = point.latitude;
+    _last_lon = point.longitude;
+    _have_fix = true;
+}
+
+// {"t":1700000000,"dur":1820,"mv":1650,"dist":9120,"gd":9050,"avg":18.1,"max":31.4,"pas":[60,0,900,700,160,0],"bt":[84,71]}
+// Times in seconds, distances in meters (dist from the odometer when there is one), speeds in km/h
+size_t BikeRide::writeSummary(char *buf, size_t size) {
+    memset(buf, 0, size);
+    JSONBufferWriter writer(buf, size - 1);
+    writer.beginObject();
+    if (_stats.start_time) {
+        writer.name("t").value((unsigned int)_stats.start_time);
+    }
+    writer.name("dur").value((unsigned int)(_stats.duration_ms / 1000));
+    writer.name("mv").value((unsigned int)(_stats.moving_ms / 1000));
+    if (_stats.have_odometer) {
+        writer.name("dist").value((unsigned int)(_stats.odometer_end - _stats.odometer_start));
+    }
+    writer.name("gd").value((unsigned int)lround(_stats.gnss_distance_m));
+    if (_stats.speed_ms) {
+        writer.name("avg").value((float)(_stats.speed_time / (double)_stats.speed_ms), 1);
+        writer.name("max").value(_stats.speed_max, 1);
+    }
+    writer.name("pas").beginArray();
+    for (size_t i = 0; i < BIKE_RIDE_PAS_LEVELS; i++) {
+        writer.value((unsigned int)(_stats.pas_ms[i] / 1000));
+    }
+    writer.endArray();
+    if (_stats.have_battery) {
+        writer.name("bt").beginArray();
+        writer.value((unsigned int)_stats.battery_start);
+        writer.value((unsigned int)_stats.battery_end);
+        writer.endArray();
+    }
+    writer.endObject();
+    return writer.dataSize();
+}
+
+// Summaries leave the queue only once the cloud acknowledged them
+void BikeRide::publishNext() {
+    if (_publishing) {
+        if (!_publish.isDone()) {
+            return;
+        }
+        _publishing = false;
+        if (_publish.isSucceeded()) {
+            _queue.popFront();
+        } else {
+            bike_ride.warn("Ride publish failed, retrying later");
+            _retry_ms = millis() + BIKE_RIDE_RETRY_MS;
+        }
+        return;
+    }
+
+    if (_queue.isEmpty() || !Particle.connected() || (long)(millis() - _retry_ms) < 0) {
+        return;
+    }
+
+    static char buf[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+    auto size = _queue.peekFrontSize();
+    if (size > particle::protocol::MAX_EVENT_DATA_LENGTH) {
+        size = particle::protocol::MAX_EVENT_DATA_LENGTH;
+    }
+    _queue.peekFront((uint8_t *)buf, size);
+    buf[size] = '\0';   // file data are not null terminated
+
+    _publish = Particle.publish("ride", buf, WITH_ACK);
+    _publishing = true;
+}
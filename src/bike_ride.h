@@ -0,0 +1,112 @@
+// Ride statistics, folded in as the ride happens
+//
+// A ride runs from the ACTIVE to the INACTIVE bike state. Every decoded batch of CAN data and
+// every GNSS fix updates a handful of running totals, so memory does not grow with the length of
+// the ride. When the ride ends a compact summary is pushed onto a DiskQueue and published as a
+// "ride" event from there, so a summary survives sleep, reboots and coverage gaps.
+#pragma once
+
+#include "Particle.h"
+#include "DiskQueue.h"
+#include "bike_canbus.h"
+
+#define BIKE_RIDE_PAS_LEVELS            (6)         // Assist levels tracked; higher levels count as the last
+#define BIKE_RIDE_MOVING_KMPH           (1.0f)      // Slower than this is standing still
+#define BIKE_RIDE_MIN_MS                (10000)     // Shorter rides that went nowhere are not reported
+#define BIKE_RIDE_GNSS_POLL_MS          (1000)
+#define BIKE_RIDE_GNSS_MAX_ACCURACY_M   (25.0f)     // Fixes less accurate than this are left out of the distance
+#define BIKE_RIDE_MAX_GAP_MS            (5000)      // Longer gaps between samples are not integrated over
+#define BIKE_RIDE_QUEUE_FILE            "/usr/ride_queue"
+#define BIKE_RIDE_QUEUE_SIZE            (16*1024)
+#define BIKE_RIDE_RETRY_MS              (60000)     // After a failed publish
+
+typedef struct {
+    time_t start_time;              // Epoch, 0 if the time was not known
+    long unsigned int start_ms;
+    long unsigned int duration_ms;
+    long unsigned int moving_ms;
+
+    bool have_odometer;
+    uint32_t odometer_start;
+    uint32_t odometer_end;
+    double gnss_distance_m;
+
+    double speed_time;              // Integral of speed (km/h) over time (ms), for the average
+    long unsigned int speed_ms;     // Time the integral covers
+    float speed_max;
+
+    long unsigned int pas_ms[BIKE_RIDE_PAS_LEVELS];
+
+    bool have_battery;
+    uint8_t battery_start;
+    uint8_t battery_end;
+} bike_ride_stats_t;
+
+class BikeRide {
+    public:
+        static BikeRide &instance()
+        {
+            if(!_instance)
+            {
+                _instance = new BikeRide();
+            }
+            return *_instance;
+        }
+
+        void setup();
+        void loop();
+
+        // Driven by the bike state machine
+        void start();
+        void end();
+
+        // Fold in the decoder's data; call whenever new data was decoded
+        void update(const bike_data_t &data);
+
+        inline bool isRiding() {
+            return _riding;
+        }
+
+    private:
+        BikeRide() :
+            _riding(false),
+            _last_sample_ms(0),
+            _last_speed(0.0f),
+            _last_pas(0),
+            _have_speed(false),
+            _have_pas(false),
+            _last_gnss_poll_ms(0),
+            _have_fix(false),
+            _last_lat(0.0),
+            _last_lon(0.0),
+            _publishing(false),
+            _retry_ms(0)
+        {
+            memset(&_stats, 0, sizeof(_stats));
+        };
+
+        static BikeRide *_instance;
+
+        bool _riding;
+        bike_ride_stats_t _stats;
+        long unsigned int _last_sample_ms;     // Last update(), the end of the ride as far as the data goes
+        float _last_speed;
+        uint8_t _last_pas;
+        bool _have_speed;
+        bool _have_pas;
+
+        long unsigned int _last_gnss_poll_ms;
+        bool _have_fix;
+        double _last_lat;
+        double _last_lon;
+
+        DiskQueue _queue;
+        particle::Future<bool> _publish;
+        bool _publishing;
+        long unsigned int _retry_ms;
+
+        void integrate(long unsigned int now_ms);
+        void updateGNSS();
+        void publishNext();
+        size_t writeSummary(char *buf, size_t size);
+};
@@ -0,0 +1,59 @@
+// Sequence lock for publishing a plain struct from one writer to any number of readers
+//
+// The writer never blocks. Readers copy the data and retry if a write happened in the middle of
+// their copy. The sequence number doubles as a version, so each reader can keep its own cursor and
+// tell whether anything changed since its last read.
+#pragma once
+
+#include <atomic>
+#include <string.h>
+
+#include "Particle.h"
+
+template <typename T>
+class BikeSeqlock {
+    public:
+        BikeSeqlock() : _seq(0) {
+            memset(&_data, 0, sizeof(T));
+        };
+
+        // Single writer only
+        void write(const T &data) {
+            uint32_t seq = _seq.load(std::memory_order_relaxed);
+            _seq.store(seq + 1, std::memory_order_relaxed);     // Odd: write in progress
+            std::atomic_thread_fence(std::memory_order_release);
+            memcpy(&_data, &data, sizeof(T));
+            std::atomic_thread_fence(std::memory_order_release);
+            _seq.store(seq + 2, std::memory_order_release);
+        }
+
+        // Returns the version of the copy placed in data
+        uint32_t read(T &data) const {
+            unsigned int attempts = 0;
+            while (true) {
+                uint32_t before = _seq.load(std::memory_order_acquire);
+                if ((before & 1) == 0) {
+                    memcpy(&data, &_data, sizeof(T));
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (_seq.load(std::memory_order_relaxed) == before) {
+                        return before;
+                    }
+                }
+                // A reader running at a higher priority than the writer would spin forever,
+                // so back off and let the writer finish
+                if (++attempts > BIKE_SEQLOCK_SPIN_ATTEMPTS) {
+                    delay(1);
+                }
+            }
+        }
+
+        uint32_t version() const {
+            return _seq.load(std::memory_order_acquire) & ~1UL;
+        }
+
+    private:
+        static constexpr unsigned int BIKE_SEQLOCK_SPIN_ATTEMPTS = 4;
+
+        std::atomic<uint32_t> _seq;
+        T _data;
+};
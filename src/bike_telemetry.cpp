@@ -0,0 +1,287 @@
+#include "Particle.h"
+#include "bike_telemetry.h"
+#include "bike_config.h"
+
+#include <math.h>
+
+BikeTelemetry *BikeTelemetry::_instance = nullptr;
+
+Logger bike_telemetry("app.bike_ts");
+
+// Keys in the "ride_ts" event, indexed by bike_ts_signal_t
+static const char *const bike_ts_names[BIKE_TS_NUM_SIGNALS] = { "sp", "pas", "bt" };
+
+bool BikeSwingingDoor::keep(const bike_ts_point_t &point) {
+    if (_count >= BIKE_TS_MAX_POINTS) {
+        return false;
+    }
+    _points[_count++] = point;
+    return true;
+}
+
+bool BikeSwingingDoor::sample(int32_t tick, int32_t value, float error) {
+    bike_ts_point_t point = { tick, value };
+
+    if (!_open) {
+        if (!keep(point)) {
+            return false;
+        }
+        _archive = point;
+        _open = true;
+        _slope_upper = INFINITY;
+        _slope_lower = -INFINITY;
+        _last = point;
+        _have_last = true;
+        _last_kept = true;
+        return true;
+    }
+
+    // Narrow the door to the slopes that keep this sample within the error bound
+    float dt = (float)(tick - _archive.tick);
+    _slope_upper = fminf(_slope_upper, ((float)value + error - (float)_archive.value) / dt);
+    _slope_lower = fmaxf(_slope_lower, ((float)value - error - (float)_archive.value) / dt);
+
+    if (_slope_lower > _slope_upper) {
+        // No single line fits any more: the previous sample ends this segment and starts the next
+        if (!_last_kept && !keep(_last)) {
+            return false;
+        }
+        _archive = _last;
+        dt = (float)(tick - _archive.tick);
+        _slope_upper = ((float)value + error - (float)_archive.value) / dt;
+        _slope_lower = ((float)value - error - (float)_archive.value) / dt;
+    }
+
+    _last = point;
+    _last_kept = false;
+    return true;
+}
+
+bool BikeSwingingDoor::close() {
+    if (_open && _have_last && !_last_kept) {
+        if (!keep(_last)) {
+            return false;
+        }
+        _last_kept = true;
+    }
+    return true;
+}
+
+bool BikeSwingingDoor::gap() {
+    bool ok = close();
+    _open = false;
+    _have_last = false;
+    return ok;
+}
+
+void BikeSwingingDoor::rebase(int32_t base) {
+    _count = 0;
+    if (!_have_last) {
+        _open = false;
+        return;
+    }
+
+    _last.tick -= base;
+    _archive = _last;
+    _points[_count++] = _last;
+    _open = true;
+    _slope_upper = INFINITY;
+    _slope_lower = -INFINITY;
+    _last_kept = true;
+}
+
+void BikeTelemetry::start() {
+    BikeConfig &config = BikeConfig::instance();
+    if (_running || !config.getTelemetryEnable()) {
+        return;
+    }
+
+    for (size_t i = 0; i < BIKE_TS_NUM_SIGNALS; i++) {
+        _doors[i].reset();
+    }
+    _tick = 0;
+    _batch_start_ms = millis();
+    _batch_time = Time.isValid() ? Time.now() : 0;
+    _last_sample_ms = _batch_start_ms - config.getTelemetrySampleMs();
+    _running = true;
+}
+
+void BikeTelemetry::end() {
+    if (!_running) {
+        return;
+    }
+    flush();
+    _running = false;
+}
+
+void BikeTelemetry::setup() {
+    if (_queue.start(BIKE_TS_QUEUE_FILE, BIKE_TS_QUEUE_SIZE, DiskQueuePolicy::FifoDeleteOld) != SYSTEM_ERROR_NONE) {
+        bike_telemetry.error("Failed to start ride_ts disk queue");
+    }
+}
+
+void BikeTelemetry::loop() {
+    publishNext();
+    if (!_running) {
+        return;
+    }
+
+    BikeConfig &config = BikeConfig::instance();
+    long unsigned int now = millis();
+    long unsigned int rate = config.getTelemetrySampleMs();
+    if (now - _last_sample_ms < rate) {
+        return;
+    }
+    // Hold the sample grid, unless loop() fell so far behind that catching up makes no sense
+    _last_sample_ms = (now - _last_sample_ms < 2 * rate) ? _last_sample_ms + rate : now;
+
+    sample();
+
+    bool full = nearlyFull();
+    for (size_t i = 0; i < BIKE_TS_NUM_SIGNALS; i++) {
+        full = full || _doors[i].full();
+    }
+    if (full || now - _batch_start_ms >= (long unsigned int)config.getTelemetryFlushS() * 1000) {
+        flush();
+    }
+}
+
+void BikeTelemetry::sample() {
+    bike_data_t data;
+    BikeCANBus::instance().getBikeData(data);
+    uint32_t stale = BikeCANBus::getStaleFields(data, millis());
+
+    struct {
+        bike_data_field_t field;
+        int32_t value;
+        float error;
+    } signals[BIKE_TS_NUM_SIGNALS] = {
+        { BIKE_DATA_SPEED, (int32_t)lroundf(data.speed * 10.0f), (float)(BikeConfig::instance().getTelemetrySpeedError() * 10.0) },
+        { BIKE_DATA_PAS_LEVEL, data.pas_level, 0.5f },     // Integer steps are kept exactly
+        { BIKE_DATA_BATTERY_PCT, data.battery_pct, 0.5f },
+    };
+
+    for (size_t i = 0; i < BIKE_TS_NUM_SIGNALS; i++) {
+        if (BikeCANBus::isFieldStale(stale, signals[i].field)) {
+            _doors[i].gap();
+        } else {
+            _doors[i].sample(_tick, signals[i].value, signals[i].error);
+        }
+    }
+    _tick++;
+}
+
+size_t BikeTelemetry::countPoints() const {
+    size_t points = 0;
+    for (size_t i = 0; i < BIKE_TS_NUM_SIGNALS; i++) {
+        points += _doors[i].count();
+    }
+    return points;
+}
+
+// True once the batch could outgrow one event before the next check: the next sample and the
+// closing flush keep at most one point per signal each
+bool BikeTelemetry::nearlyFull() {
+    size_t points = countPoints();
+    if (points != _measured_points) {
+        // Measured with the writer that encodes it; a zero-size buffer only counts
+        char none[1];
+        JSONBufferWriter writer(none, 0);
+        writeJSON(writer);
+        _encoded_size = writer.dataSize();
+        _measured_points = points;
+    }
+    return _encoded_size + 2 * BIKE_TS_NUM_SIGNALS * BIKE_TS_POINT_MAX_CHARS > particle::protocol::MAX_EVENT_DATA_LENGTH;
+}
+
+// {"t":1700000000,"ms":500,"sp":[0,0,12,153,40,-8],"pas":[0,2],"bt":[0,81]}
+// For each signal: the first point's tick and value, then tick and value deltas to each next point.
+// A point at a negative tick was carried over from the previous batch.
+void BikeTelemetry::writeJSON(JSONWriter &writer) {
+    writer.beginObject();
+    if (_batch_time) {
+        writer.name("t").value((unsigned int)_batch_time);
+    }
+    writer.name("ms").value((int)BikeConfig::instance().getTelemetrySampleMs());
+    for (size_t i = 0; i < BIKE_TS_NUM_SIGNALS; i++) {
+        const BikeSwingingDoor &door = _doors[i];
+        if (door.count() == 0) {
+            continue;
+        }
+        writer.name(bike_ts_names[i]).beginArray();
+        bike_ts_point_t prev = { 0, 0 };
+        for (size_t p = 0; p < door.count(); p++) {
+            const bike_ts_point_t &point = door.point(p);
+            writer.value((int)(point.tick - prev.tick));
+            writer.value((int)(point.value - prev.value));
+            prev = point;
+        }
+        writer.endArray();
+    }
+    writer.endObject();
+}
+
+void BikeTelemetry::flush() {
+    for (size_t i = 0; i < BIKE_TS_NUM_SIGNALS; i++) {
+        _doors[i].close();
+    }
+    size_t points = countPoints();
+
+    if (points) {
+        static char buf[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+        memset(buf, 0, sizeof(buf));
+        JSONBufferWriter writer(buf, sizeof(buf) - 1);
+        writeJSON(writer);
+
+        if (writer.dataSize() > writer.bufferSize()) {
+            // Cut off JSON is no use to the backend; nearlyFull() flushes well before this
+            _dropped++;
+            bike_telemetry.error("ride_ts batch of %u bytes does not fit an event, dropped (%lu dropped)", writer.dataSize(), _dropped);
+        } else if (!_queue.pushBack(String(buf))) {
+            _dropped++;
+            bike_telemetry.warn("Unable to write ride_ts batch to DiskQueue, discarding (%lu dropped)", _dropped);
+        }
+        bike_telemetry.trace("Flushed %u points over %ld samples", points, _tick);
+    }
+
+    for (size_t i = 0; i < BIKE_TS_NUM_SIGNALS; i++) {
+        _doors[i].rebase(_tick);
+    }
+    _tick = 0;
+    _batch_start_ms = millis();
+    _batch_time = Time.isValid() ? Time.now() : 0;
+    _measured_points = 0;
+    _encoded_size = 0;
+}
+
+// Batches leave the queue only once the cloud acknowledged them
+void BikeTelemetry::publishNext() {
+    if (_publishing) {
+        if (!_publish.isDone()) {
+            return;
+        }
+        _publishing = false;
+        if (_publish.isSucceeded()) {
+            _queue.popFront();
+        } else {
+            bike_telemetry.warn("ride_ts publish failed, retrying later");
+            _retry_ms = millis() + BIKE_TS_RETRY_MS;
+        }
+        return;
+    }
+
+    if (_queue.isEmpty() || !Particle.connected() || (long)(millis() - _retry_ms) < 0) {
+        return;
+    }
+
+    static char buf[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+    auto size = _queue.peekFrontSize();
+    if (size > particle::protocol::MAX_EVENT_DATA_LENGTH) {
+        size = particle::protocol::MAX_EVENT_DATA_LENGTH;
+    }
+    _queue.peekFront((uint8_t *)buf, size);
+    buf[size] = '\0';   // file data are not null terminated
+
+    _publish = Particle.publish("ride_ts", buf, WITH_ACK);
+    _publishing = true;
+}
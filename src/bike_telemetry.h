@@ -0,0 +1,143 @@
+// Compressed time series of the decoded signals, published as "ride_ts" events
+//
+// While the bike is active, speed, assist level and battery are sampled at a fixed rate and run
+// through swinging-door compression: a point is only kept when a straight line from the last kept
+// point can no longer pass within the error bound of every sample since. A steady cruise costs two
+// points no matter how long it lasts. Kept points are flushed once a minute, when a buffer fills
+// up, or when the encoded batch gets close to the event size, as one batch with delta-encoded
+// times and values. Batches go onto a DiskQueue and are
+// published from there with an acknowledgement, like ride summaries, so they survive coverage gaps.
+#pragma once
+
+#include "Particle.h"
+#include "DiskQueue.h"
+#include "bike_canbus.h"
+
+#define BIKE_TS_MAX_POINTS              (32)    // Kept points per signal between flushes
+#define BIKE_TS_POINT_MAX_CHARS         (32)    // One point's encoded deltas at most, with room for its signal's key
+#define BIKE_TS_QUEUE_FILE              "/usr/ride_ts_queue"
+#define BIKE_TS_QUEUE_SIZE              (32*1024)   // The oldest batches go first once full
+#define BIKE_TS_RETRY_MS                (60000)     // After a failed publish
+
+typedef enum {
+    BIKE_TS_SPEED,                  // 0.1 km/h
+    BIKE_TS_PAS,
+    BIKE_TS_BATTERY,                // %
+    BIKE_TS_NUM_SIGNALS
+} bike_ts_signal_t;
+
+typedef struct {
+    int32_t tick;                   // Samples since the start of the batch; negative for a point carried over
+    int32_t value;                  // Scaled as in bike_ts_signal_t
+} bike_ts_point_t;
+
+// Swinging-door compressor for one signal. Values are in the signal's scaled units.
+class BikeSwingingDoor {
+    public:
+        BikeSwingingDoor() {
+            reset();
+        };
+
+        // Forget everything, including the kept points
+        void reset() {
+            _count = 0;
+            _open = false;
+            _have_last = false;
+        }
+
+        // Feed a sample. Kept points go to the point buffer; returns false if it is full. At most
+        // one point is kept per sample.
+        bool sample(int32_t tick, int32_t value, float error);
+
+        // Keep the last sample so the series ends where the signal did. Returns false if full.
+        bool close();
+
+        // The signal dropped out: end the series here and start a new one with the next sample
+        bool gap();
+
+        // Start a new batch at tick base of the old one: the kept points are cleared and the last
+        // sample becomes the first point of the new batch
+        void rebase(int32_t base);
+
+        inline size_t count() const {
+            return _count;
+        }
+        inline const bike_ts_point_t &point(size_t index) const {
+            return _points[index];
+        }
+        inline bool full() const {
+            return _count >= BIKE_TS_MAX_POINTS;
+        }
+
+    private:
+        bike_ts_point_t _points[BIKE_TS_MAX_POINTS];
+        size_t _count;
+
+        bool _open;                     // A door is open from _archive
+        bike_ts_point_t _archive;       // Last kept point
+        bool _have_last;
+        bike_ts_point_t _last;          // Last sample, kept if the door closes on the next one
+        bool _last_kept;
+        float _slope_upper;             // Tightest slopes so far from _archive
+        float _slope_lower;
+
+        bool keep(const bike_ts_point_t &point);
+};
+
+class BikeTelemetry {
+    public:
+        static BikeTelemetry &instance()
+        {
+            if(!_instance)
+            {
+                _instance = new BikeTelemetry();
+            }
+            return *_instance;
+        }
+
+        void setup();
+        void loop();
+
+        // Driven by the bike state machine
+        void start();
+        void end();
+
+    private:
+        BikeTelemetry() :
+            _running(false),
+            _batch_start_ms(0),
+            _batch_time(0),
+            _last_sample_ms(0),
+            _tick(0),
+            _dropped(0),
+            _publishing(false),
+            _retry_ms(0),
+            _measured_points(0),
+            _encoded_size(0)
+        {};
+
+        static BikeTelemetry *_instance;
+
+        bool _running;
+        BikeSwingingDoor _doors[BIKE_TS_NUM_SIGNALS];
+        long unsigned int _batch_start_ms;
+        time_t _batch_time;             // Epoch of tick 0, 0 if not known
+        long unsigned int _last_sample_ms;
+        int32_t _tick;
+        uint32_t _dropped;              // Batches that could not be queued
+
+        DiskQueue _queue;
+        particle::Future<bool> _publish;
+        bool _publishing;
+        long unsigned int _retry_ms;
+
+        size_t _measured_points;        // Kept points when _encoded_size was worked out
+        size_t _encoded_size;
+
+        void sample();
+        void flush();
+        size_t countPoints() const;
+        bool nearlyFull();
+        void writeJSON(JSONWriter &writer);
+        void publishNext();
+};
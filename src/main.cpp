@@ -22,6 +22,16 @@
 
 #include "bike_canbus.h"
 #include "bike_config.h"
+#include "bike_can_publish.h"
+#include "bike_can_signals.h"
+#include "bike_can_stats.h"
+#include "bike_can_discovery.h"
+#include "bike_can_diag.h"
+#include "bike_ride.h"
+#include "bike_telemetry.h"
+#include "bike_range.h"
+#include "bike_battery.h"
+#include "bike_blog.h"
 
 #include "bcycle_ble.h"
 
@@ -38,6 +48,7 @@ void locationGenerationCallback(JSONWriter &writer, LocationPoint &point, const
 void wakeCallback(TrackerSleepContext context);
 void prepareSleepCallback(TrackerSleepContext context);
 void sleepCallback(TrackerSleepContext context);
+void bikeCANEventCallback(bike_can_event_t event);
 
 // for publishing the nRF serial number
 bool publish_serial_number_flag = false;
@@ -46,10 +57,26 @@ int publishSerialNumber(String extra) {
     return 0;
 }
 
+int publishCANStats(String extra) {
+    BikeCANStats::instance().requestPublish();
+    return 0;
+}
+
+int canDiscovery(String extra) {
+    return BikeCANDiscovery::instance().command(extra);
+}
+
+// Returns as soon as the frames are queued; the outcome is published as "bike_off" once they are sent
 int sendBikeOff(String extra) {
     if (BikeCANBus::instance().isActive()) {
-        BikeCANBus::instance().turnBikeOff();
-        return 0;
+        return BikeCANBus::instance().turnBikeOff([](long unsigned int id, bike_can_tx_result_t result, uint8_t sent) {
+            if (result == BIKE_CAN_TX_OK) {
+                Log.info("Bike should be off?");
+            }
+            char pub_str[64] = { 0 };
+            snprintf(pub_str, sizeof(pub_str), "{\"ok\":%s,\"sent\":%u}", (result == BIKE_CAN_TX_OK) ? "true" : "false", sent);
+            Particle.publish("bike_off", pub_str);
+        });
     } else {
         return -1;
     }
@@ -68,6 +95,11 @@ SerialLogHandler logHandler(115200, LOG_LEVEL_ALL, {
 });
 
 bike_data_t data;
+uint32_t data_cursor = 0;   // Version of the bike data last copied into data
+
+// Odometer at the last loc publish, for the distance trigger
+bool publish_odometer_valid = false;
+uint32_t publish_odometer = 0;
 
 typedef enum {
     STATE_BIKE_INACTIVE = 0,
@@ -83,7 +115,6 @@ inline const char * stateToStr(system_state_t state) {
 };
 
 system_state_t state = STATE_BIKE_INACTIVE;
-system_state_t next_state = STATE_BIKE_INACTIVE;
 
 void setup()
 {
@@ -128,8 +159,16 @@ void setup()
 
     // Custom configs
     BikeConfig::instance().setup();
+    BikeCANSignals::instance().setup();
+    BikeCANDiag::instance().setup();
 
     // Initialize Bike CAN Bus
+    BikeCANStats::instance().setup();
+    BikeRide::instance().setup();
+    BikeTelemetry::instance().setup();
+    BikeRange::instance().setup();
+    BikeBattery::instance().setup();
+    BikeCANBus::instance().registerEventCallback(bikeCANEventCallback);
     BikeCANBus::instance().setup();
 
     // Initialize BCycle BBT BLE stack
@@ -138,6 +177,8 @@ void setup()
     // Functions
     Particle.function("Get Serial Number", publishSerialNumber);
     Particle.function("Bike Off", sendBikeOff);
+    Particle.function("CAN Stats", publishCANStats);
+    Particle.function("CAN Discovery", canDiscovery);
 
     // Connect to the cloud!
     Particle.connect();
@@ -145,64 +186,91 @@ void setup()
 }
 
 void locationGenerationCallback(JSONWriter &writer, LocationPoint &point, const void *context) {
-    writer.name("can").beginObject();
-        writer.name("sp").value(data.speed, 2);
-        writer.name("bt").value(data.battery_pct);
-        writer.name("odo").value(data.odometer);
-        writer.name("pas").value(data.pas_level);
-    writer.endObject();
+    // Take our own consistent snapshot rather than whatever loop() last copied
+    bike_data_t snapshot;
+    BikeCANBus::instance().getBikeData(snapshot);
+
+    BikeCANPublish::instance().writeJSON(writer, snapshot);
+
+    // Any publish restarts the distance count, whatever triggered it
+    uint32_t stale = BikeCANBus::getStaleFields(snapshot, millis());
+    if (!BikeCANBus::isFieldStale(stale, BIKE_DATA_ODOMETER)) {
+        publish_odometer = snapshot.odometer;
+        publish_odometer_valid = true;
+    }
 }
 
-void loop()
-{
-    Tracker::instance().loop();
-    BikeCANBus::instance().loop();
+// Drives the ACTIVE/INACTIVE state machine. Called from BikeCANBus::loop() on the application thread.
+void bikeCANEventCallback(bike_can_event_t event) {
+    system_state_t next_state = state;
+
+    switch(event) {
+        // CAN data showed up: stay awake and publish
+        case BIKE_CAN_EVENT_ACTIVE: {
+            TrackerSleep::instance().pauseSleep();
+            BikeCANPublish::instance().requestKeyframe();
+            TrackerLocation::instance().triggerLocPub(Trigger::IMMEDIATE, "active");
+            BikeRide::instance().start();
+            BikeTelemetry::instance().start();
+            BikeBattery::instance().start();
+            next_state = STATE_BIKE_ACTIVE;
+            break;
+        }
 
-    switch(state) {
-        // CAN Bus is inactive
-        case STATE_BIKE_INACTIVE: {
-            if (BikeCANBus::instance().isActive()) {
-                // If we get CAN data, stay awake and publish
-                TrackerSleep::instance().pauseSleep();
-                TrackerLocation::instance().triggerLocPub(Trigger::IMMEDIATE, "active");
-                next_state = STATE_BIKE_ACTIVE;
-            } else {
-                TrackerSleep::instance().resumeSleep();
-                next_state = STATE_BIKE_INACTIVE;
-            }
+        // We've gone inactive
+        case BIKE_CAN_EVENT_INACTIVE: {
+            TrackerSleep::instance().resumeSleep();
+
+            int32_t idle_timeout_s = BikeConfig::instance().getIdleTimeout();
+            TrackerSleep::instance().extendExecutionFromNow(idle_timeout_s);
+            Log.info("Bike Idle: sleeping in %li seconds", idle_timeout_s);
+            TrackerLocation::instance().triggerLocPub(Trigger::IMMEDIATE, "inactive");
+            BikeRide::instance().end();
+            BikeTelemetry::instance().end();
+            BikeRange::instance().save();
+            BikeBattery::instance().end();
+            next_state = STATE_BIKE_INACTIVE;
             break;
         }
 
         // CAN Bus is active: constantly publish at maximum rate while bike is moving more than 5 mph (8 kmph)
-        case STATE_BIKE_ACTIVE: {
-            if (!BikeCANBus::instance().isActive()) {
-                // We've gone inactive
-                TrackerSleep::instance().resumeSleep();
-
-                int32_t idle_timeout_s = BikeConfig::instance().getIdleTimeout();
-                TrackerSleep::instance().extendExecutionFromNow(idle_timeout_s);
-                Log.info("Bike Idle: sleeping in %li seconds", idle_timeout_s);
-                TrackerLocation::instance().triggerLocPub(Trigger::IMMEDIATE, "inactive");
-                next_state = STATE_BIKE_INACTIVE;
-            } else {
-                // Refresh our shadow copy of bike data
-                if (BikeCANBus::instance().isDataFresh()) { 
-
-                    BikeCANBus::instance().getBikeData(data);
-                    BCycleBLE::instance().updateData(data);
-
-                    static long unsigned int last_publish = 0;
-                    long unsigned int max_interval_ms = TrackerLocation::instance().getMaxInterval() * 1000;
-                    
-                    if ((millis() - last_publish >= max_interval_ms)) {
-                        if (data.speed > (float)(BikeConfig::instance().getPublishTriggerSpeed())) {
-                            Log.info("Publishing due to speed (%0.2f km/h)", (float)data.speed);
-                            TrackerLocation::instance().triggerLocPub(Trigger::IMMEDIATE, "speed");
-                            last_publish = millis();
-                        }
+        case BIKE_CAN_EVENT_DATA: {
+            if (state != STATE_BIKE_ACTIVE) {
+                break;
+            }
+
+            // Refresh our shadow copy of bike data
+            BikeCANBus::instance().getBikeData(data, data_cursor);
+            BikeRide::instance().update(data);
+            BikeRange::instance().update(data);
+
+            // Triggers still go through the TrackerLocation min interval, and the max interval
+            // publishes on its own; this only keeps us from piling up triggers in between
+            static long unsigned int last_publish = 0;
+            int32_t min_interval_s = TrackerLocation::instance().getMinInterval();
+            long unsigned int min_interval_ms = (min_interval_s > 1 ? min_interval_s : 1) * 1000;
+            uint32_t stale = BikeCANBus::getStaleFields(data, millis());
+            int32_t publish_distance_m = BikeConfig::instance().getPublishDistance();
+
+            if (publish_distance_m > 0) {
+                // Every publish_distance_m of odometer progress, however fast the bike goes
+                if (!BikeCANBus::isFieldStale(stale, BIKE_DATA_ODOMETER)) {
+                    if (!publish_odometer_valid || data.odometer < publish_odometer) {
+                        publish_odometer = data.odometer;
+                        publish_odometer_valid = true;
+                    } else if (data.odometer - publish_odometer >= (uint32_t)publish_distance_m && millis() - last_publish >= min_interval_ms) {
+                        Log.info("Publishing due to distance (%lu m)", data.odometer - publish_odometer);
+                        TrackerLocation::instance().triggerLocPub(Trigger::IMMEDIATE, "distance");
+                        publish_odometer = data.odometer;
+                        last_publish = millis();
                     }
                 }
-                next_state = STATE_BIKE_ACTIVE;
+            } else if (millis() - last_publish >= min_interval_ms) {
+                if (!BikeCANBus::isFieldStale(stale, BIKE_DATA_SPEED) && data.speed > (float)(BikeConfig::instance().getPublishTriggerSpeed())) {
+                    Log.info("Publishing due to speed (%0.2f km/h)", (float)data.speed);
+                    TrackerLocation::instance().triggerLocPub(Trigger::IMMEDIATE, "speed");
+                    last_publish = millis();
+                }
             }
             break;
         }
@@ -212,6 +280,20 @@ void loop()
         Log.info("State Transition: %s -> %s", stateToStr(state), stateToStr(next_state));
         state = next_state;
     }
+}
+
+void loop()
+{
+    Tracker::instance().loop();
+    BikeCANBus::instance().loop();
+    BikeCANStats::instance().loop();
+    BikeCANDiscovery::instance().loop();
+    BikeCANDiag::instance().loop();
+    BikeRide::instance().loop();
+    BikeTelemetry::instance().loop();
+    BikeBattery::instance().loop();
+    BCycleBLE::instance().loop();
+    BikeBinLog::instance().loop();      // Last, so the drain only gets what time is left
 
     if (publish_serial_number_flag == true) {
         char pub_str[64] = { 0 };
@@ -225,29 +307,57 @@ void sleepCallback(TrackerSleepContext context)
 {
     // Called before we go to sleep. Adjust the time so we do a short wake every 60 minutes
     Log.info("sleep callback ��shutting MCP down");
-    BikeCANBus::instance().sleepCallback();
+    BikeCANBus::instance().sleepCallback(BikeConfig::instance().getSniffIntervalMs() > 0);
 }
 
 void prepareSleepCallback(TrackerSleepContext context)
 {
     BikeCANBus::instance().sleepPrepareCallback();
+
+    // With a sniff interval the MCP sleeps through bus activity and we check in on it on a schedule
+    int32_t sniff_interval = BikeConfig::instance().getSniffIntervalMs();
+    TrackerSleep::instance().sniffEvery(sniff_interval, [](TrackerSleepContext context) {
+        // Back to sleep unless a ride-start frame showed up
+        return !BikeCANBus::instance().sniff(BikeConfig::instance().getSniffWindowMs());
+    });
+    if (sniff_interval > 0) {
+        Log.info("Sniffing every %li ms (~%0.1f uA modelled)", sniff_interval, BikeCANBus::instance().getSniffCurrentModelUA(sniff_interval));
+    }
+}
+
+// Bus activity woke us: either bring up the network straight away, or stay on a short wake while
+// BikeCANBus decides if a ride is starting. If it is, the "active" publish brings up the network.
+void canWake()
+{
+    int32_t triage_ms = BikeConfig::instance().getWakeTriageMs();
+    if (triage_ms > 0) {
+        TrackerSleep::instance().extendExecutionFromNow((triage_ms + 999) / 1000 + 1);
+        BikeCANBus::instance().startWakeTriage(triage_ms);
+    } else {
+        TrackerSleep::instance().forceFullWakeCycle();
+    }
 }
 
 void wakeCallback(TrackerSleepContext context)
 {
     // Called when we wake from sleep
+    bool sniff_wake = BikeCANBus::instance().takeSniffWake();
     if (!TrackerSleep::instance().isFullWakeCycle()) {
-        if (context.result.wakeupReason() == SystemSleepWakeupReason::BY_GPIO) {
+        if (sniff_wake) {
+            Log.info("Wakeup: CAN sniff");
+            canWake();
+        }
+        else if (context.result.wakeupReason() == SystemSleepWakeupReason::BY_GPIO) {
             if (context.result.wakeupPin() == CAN_INT) {
-                Log.info("Wakeup: CAN Interrupt. Forcing full wake");
-                TrackerSleep::instance().forceFullWakeCycle();
+                Log.info("Wakeup: CAN Interrupt");
+                canWake();
             } else {
                 Log.info("Wakeup: GPIO (pin=%d)", context.result.wakeupPin());
             }
         }
         else if(!digitalRead(CAN_INT)) {
-            Log.info("Wakeup: no CAN Interrupt, but CAN is active. Forcing full wake");
-            TrackerSleep::instance().forceFullWakeCycle();
+            Log.info("Wakeup: no CAN Interrupt, but CAN is active");
+            canWake();
         }
         else {
             Log.info("Wakeup: Other (%u)", (uint16_t)context.result.wakeupReason());
@@ -224,6 +224,12 @@ int TrackerSleep::registerWake(SleepCallback callback) {
   return SYSTEM_ERROR_NONE;
 }
 
+int TrackerSleep::sniffEvery(system_tick_t interval, SleepSniffCallback callback) {
+  _sniffIntervalMs = interval;
+  _onSniff = callback;
+  return SYSTEM_ERROR_NONE;
+}
+
 int TrackerSleep::registerStateChange(SleepCallback callback) {
   _onStateTransition.append(callback);
   return SYSTEM_ERROR_NONE;
@@ -356,12 +362,49 @@ TrackerSleepResult TrackerSleep::sleep() {
   if (_lastSleepMs >= _nextWakeMs) {
     duration = TrackerSleepMinSleepDuration; // Sleep for at least 1 second
   }
-  config.duration(duration);
-
   _lastRequestedWakeMs = _lastSleepMs + duration;
   sleepLog.info("sleeping until %lu milliseconds", (uint32_t)_lastRequestedWakeMs);
 
-  retval.result = System.sleep(config);
+  // Sleep in slices of the sniff interval, if any, and go back to sleep for as long as the sniff
+  // callback asks us to and there is enough time left before the requested wake
+  auto sniffInterval = (_onSniff) ? _sniffIntervalMs : 0;
+  // The first slice is at least TrackerSleepMinSleepDuration; later ones are checked below
+  int64_t remaining = (int64_t)duration;
+  while (true) {
+    auto slice = ((sniffInterval > 0) && ((int64_t)sniffInterval < remaining)) ? (system_tick_t)sniffInterval : (system_tick_t)remaining;
+    config.duration(slice);
+
+    retval.result = System.sleep(config);
+
+    if ((sniffInterval == 0) || (retval.result.wakeupReason() != SystemSleepWakeupReason::BY_RTC)) {
+      break;
+    }
+
+    auto now = System.millis();
+    if (now + TrackerSleepMinSleepDuration >= _lastRequestedWakeMs) {
+      break;
+    }
+
+    _sniffCount++;
+    TrackerSleepContext sniffContext = {
+      .reason = TrackerSleepReason::SNIFF,
+      .result = retval.result,
+      .loop = _loopCount,
+      .lastSleepMs = _lastSleepMs,
+      .lastWakeMs = now,
+      .nextWakeMs = _nextWakeMs,
+      .modemOnMs = _lastModemOnMs,
+    };
+    if (!_onSniff(sniffContext)) {
+      break;
+    }
+
+    // Signed, so a sniff window that ran past the requested wake ends the sleep instead of wrapping
+    remaining = (int64_t)_lastRequestedWakeMs - (int64_t)System.millis();
+    if (remaining <= (int64_t)TrackerSleepMinSleepDuration) {
+      break;
+    }
+  }
 
   // Capture the wake time to help calculate the next sleep cycle
   _lastWakeMs = System.millis();
@@ -67,6 +67,7 @@ enum class TrackerSleepReason {
   CANCEL_SLEEP,                   /**< The system canceled sleep */
   SLEEP,                          /**< The system is going to sleep */
   WAKE,                           /**< The system woke from sleep */
+  SNIFF,                          /**< The system woke briefly to sniff and may go back to sleep */
   STATE_TO_CONNECTING,            /**< Sleep transition to CONNECTING */
   STATE_TO_EXECUTION,             /**< Sleep transition to EXECUTION */
   STATE_TO_SLEEP,                 /**< Sleep transition to SLEEP */
@@ -109,6 +110,12 @@ using SleepWatchdogCallback = std::function<void(bool enable)>;
  */
 using SleepCallback = std::function<void(TrackerSleepContext context)>;
 
+/**
+ * @brief Type definition of sleep sniff callback signature.  Return true to go back to sleep.
+ *
+ */
+using SleepSniffCallback = std::function<bool(TrackerSleepContext context)>;
+
 /**
  * @brief Execution states for sleep
  *
@@ -377,6 +384,28 @@ public:
    */
   int registerStateChange(SleepCallback callback);
 
+  /**
+   * @brief Wake briefly at a fixed interval while sleeping and let a callback decide whether to resume sleep.
+   *
+   * The callback is called with the modem, GNSS and watchdog still off and before any wake callbacks.  Returning
+   * true goes straight back to sleep until the next interval or the scheduled wake, whichever is sooner.
+   * Returning false ends the sleep and wakes the system normally.  Takes effect from the next sleep.
+   *
+   * @param interval Milliseconds between sniffs, 0 to disable sniffing
+   * @param callback Function to call on each sniff
+   * @retval SYSTEM_ERROR_NONE
+   */
+  int sniffEvery(system_tick_t interval, SleepSniffCallback callback);
+
+  /**
+   * @brief Number of sniffs performed since boot.
+   *
+   * @return uint32_t Sniff count
+   */
+  uint32_t getSniffCount() const {
+    return _sniffCount;
+  }
+
   /**
    * @brief Indicate that the current connecting/execution phase has cellular modem and GNSS powered.
    *
@@ -463,7 +492,9 @@ private:
     _lastNetworkConnectMs(0),
     _lastCloudConnectMs(0),
     _loopCount(0),
-    _publishFlag(false)
+    _publishFlag(false),
+    _sniffIntervalMs(0),
+    _sniffCount(0)
 
     {
 
@@ -580,6 +611,7 @@ private:
   Vector<SleepCallback> _onSleep;
   Vector<SleepCallback> _onWake;
   Vector<SleepCallback> _onStateTransition;
+  SleepSniffCallback _onSniff;
 
   // Sleep conditions
   Vector<std::pair<pin_t,InterruptMode>> _onPin;
@@ -614,4 +646,6 @@ private:
   uint64_t _lastCloudConnectMs;
   size_t _loopCount;
   bool _publishFlag;
+  system_tick_t _sniffIntervalMs;
+  uint32_t _sniffCount;
 };
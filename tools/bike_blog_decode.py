@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+"""Decode the Tracker binary log back into text.
+
+Reads either a serial log capture (lines containing "BL <hex>" from the app.blog logger) or a raw
+blog.bin file pulled from flash, and prints one line per record. The format table is read from
+src/bike_blog_formats.h, so run it against the same source the firmware was built from.
+
+    tools/bike_blog_decode.py serial.log
+    tools/bike_blog_decode.py blog.1.bin blog.bin
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+RECORD = struct.Struct("<IHBB4I")
+LEVELS = {0: "ALL", 1: "TRACE", 30: "INFO", 40: "WARN", 50: "ERROR", 60: "PANIC", 70: "NONE"}
+CATEGORIES = {
+    "BIKE_BLOG_CAT_CAN": "app.bike_can",
+    "BIKE_BLOG_CAT_CAN_RAW": "app.bike_can.raw",
+    "BIKE_BLOG_CAT_MCP": "app.mcp25625",
+}
+FORMAT_RE = re.compile(r'^BIKE_BLOG_FORMAT\(\s*(\w+)\s*,\s*(\w+)\s*,\s*"((?:[^"\\]|\\.)*)"\s*\)', re.M)
+SPEC_RE = re.compile(r"%[-+ #0]*\d*(?:\.\d+)?(?:hh|h|ll|l)?([diouxXeEfgGc%])")
+HEX_RE = re.compile(r"\bBL ([0-9a-f]{%d})\b" % (RECORD.size * 2))
+
+
+def load_formats(path):
+    with open(path) as f:
+        return [(name, CATEGORIES.get(cat, cat), fmt) for name, cat, fmt in FORMAT_RE.findall(f.read())]
+
+
+def render(fmt, words):
+    """Apply a C format string to 32-bit argument words."""
+    args = []
+    words = iter(words)
+    for spec in SPEC_RE.finditer(fmt):
+        conv = spec.group(1)
+        if conv == "%":
+            continue
+        word = next(words, 0)
+        if conv in "eEfgG":
+            args.append(struct.unpack("<f", struct.pack("<I", word))[0])
+        elif conv in "di":
+            args.append(word - (1 << 32) if word & 0x80000000 else word)
+        else:
+            args.append(word)
+    # Python takes C length modifiers but not every spelling of them
+    return re.sub(r"(hh|ll)(?=[diouxX])", "", fmt) % tuple(args)
+
+
+def decode(raw, formats):
+    time_ms, fmt_id, level, num_args, *words = RECORD.unpack(raw)
+    if fmt_id >= len(formats):
+        return "%10u [%s] unknown format %u: %s" % (time_ms, LEVELS.get(level, level), fmt_id, raw.hex())
+    name, category, fmt = formats[fmt_id]
+    return "%10u %s [%s] %s" % (time_ms, category, LEVELS.get(level, level), render(fmt, words[:num_args]))
+
+
+def records(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if path.endswith(".bin"):
+        for i in range(0, len(data) - RECORD.size + 1, RECORD.size):
+            yield data[i:i + RECORD.size]
+    else:
+        for match in HEX_RE.finditer(data.decode("latin-1")):
+            yield bytes.fromhex(match.group(1))
+
+
+def main():
+    default_formats = os.path.join(os.path.dirname(__file__), "..", "src", "bike_blog_formats.h")
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("files", nargs="+", help="serial log captures or .bin files from flash")
+    parser.add_argument("--formats", default=default_formats, help="path to bike_blog_formats.h")
+    args = parser.parse_args()
+
+    formats = load_formats(args.formats)
+    for path in args.files:
+        for raw in records(path):
+            print(decode(raw, formats))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,215 @@
+// Host check and benchmark for the table driven CAN decoder (src/bike_can_decoder.h)
+//
+// Decodes synthetic frames with the decoder and with the hand-written switch it replaced, and
+// stops at the first frame where bike_data_t differs. The integer scaling paths are checked the
+// same way against the plain 64-bit expression over random raw values. Then both decoders are
+// timed over the same frames.
+//
+//     g++ -O2 -std=gnu++17 -Wall -Wextra -I src tools/bike_can_decoder_bench.cpp -o /tmp/bike_can_decoder_bench
+//     /tmp/bike_can_decoder_bench [frames]
+//
+// Host timings only show relative cost; the MCU numbers come from running the same loops on the
+// target.
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bike_can_decoder.h"
+
+#define CAN_ID_EXT_FLAG                 (0x80000000UL)
+
+static constexpr BikeCANDecoder<bosch_can_signals> decoder;
+
+// processCANFrame() as it was before the signal table, without the logging
+static bool decodeSwitch(const can_frame_t &frame, bike_data_t &data) {
+    switch (frame.rxId) {
+        case 0x03B:
+            if (frame.len == 4) {
+                data.pas_level = frame.rxBuf[0];
+                return true;
+            }
+            break;
+        case 0x0D1:
+            if (frame.len == 2) {
+                uint16_t speed_temp = (uint16_t)(frame.rxBuf[0] << 8) | (uint16_t)frame.rxBuf[1];
+                data.speed = ((float)speed_temp) / 100.0f;
+                return true;
+            }
+            break;
+        case 0x111:
+            if (frame.len == 7) {
+                data.battery_capacity = ((float)frame.rxBuf[5]) / 10.0f;
+                data.battery_pct = frame.rxBuf[6];
+                return true;
+            }
+            break;
+        case 0x202:
+            if (frame.len == 8) {
+                data.odometer  = (uint32_t)(frame.rxBuf[0] << 24);
+                data.odometer |= (uint32_t)(frame.rxBuf[1] << 16);
+                data.odometer |= (uint32_t)(frame.rxBuf[2] <<  8);
+                data.odometer |= (uint32_t)(frame.rxBuf[3]);
+                return true;
+            }
+            break;
+        case 0x203:
+            if (frame.len == 8) {
+                data.battery_time_since_full  = (uint32_t)(frame.rxBuf[0] << 24);
+                data.battery_time_since_full |= (uint32_t)(frame.rxBuf[1] << 16);
+                data.battery_time_since_full |= (uint32_t)(frame.rxBuf[2] <<  8);
+                data.battery_time_since_full |= (uint32_t)(frame.rxBuf[3]);
+                return true;
+            }
+            break;
+    }
+    return false;
+}
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t rng() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// Half known IDs, the rest unknown standard and extended IDs; 1 in 16 with a random DLC
+static void makeFrames(can_frame_t *frames, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        can_frame_t &frame = frames[i];
+        memset(&frame, 0, sizeof(frame));
+        uint32_t pick = rng();
+        if (pick & 1) {
+            const auto &msg = *decoder.findMessage(decoder.messageId((pick >> 1) % decoder.numMessages()));
+            frame.rxId = msg.id;
+            frame.len = msg.dlc;
+        } else if (pick & 2) {
+            frame.rxId = (pick >> 2) & 0x7ff;
+            frame.len = 8;
+        } else {
+            frame.rxId = CAN_ID_EXT_FLAG | ((pick >> 2) & 0x1fffffff);
+            frame.len = 8;
+        }
+        if ((rng() & 0xf) == 0) {
+            frame.len = rng() % 9;
+        }
+        for (size_t b = 0; b < 8; b++) {
+            frame.rxBuf[b] = (uint8_t)rng();
+        }
+        frame.rxTimeMs = (long unsigned int)i;
+    }
+}
+
+static bool sameValues(bike_data_t a, bike_data_t b) {
+    // The switch never kept reception times
+    memset(a.updated_ms, 0, sizeof(a.updated_ms));
+    memset(b.updated_ms, 0, sizeof(b.updated_ms));
+    return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+// Rows covering each integer scaling path, checked against the 64-bit expression
+constexpr bike_can_signal_t scaling_signals[] = {
+    { 0x100, 8, 0, 4, BIKE_SIG_BIG_ENDIAN,    1,   1,     0, BIKE_FIELD(odometer, BIKE_FIELD_U32, BIKE_DATA_ODOMETER), "add" },
+    { 0x101, 8, 0, 4, BIKE_SIG_BIG_ENDIAN,    1,   1,  -100, BIKE_FIELD(odometer, BIKE_FIELD_U32, BIKE_DATA_ODOMETER), "add_neg" },
+    { 0x102, 8, 0, 4, BIKE_SIG_LITTLE_ENDIAN, 1,  16,     3, BIKE_FIELD(odometer, BIKE_FIELD_U32, BIKE_DATA_ODOMETER), "shift" },
+    { 0x103, 8, 0, 2, BIKE_SIG_BIG_ENDIAN,   10,   3,     0, BIKE_FIELD(odometer, BIKE_FIELD_U32, BIKE_DATA_ODOMETER), "div32" },
+    { 0x104, 8, 0, 1, BIKE_SIG_BIG_ENDIAN,    5,   7,   -20, BIKE_FIELD(pas_level, BIKE_FIELD_U8, BIKE_DATA_PAS_LEVEL), "div32_u8" },
+    { 0x105, 8, 0, 4, BIKE_SIG_BIG_ENDIAN,   10,   3,     0, BIKE_FIELD(odometer, BIKE_FIELD_U32, BIKE_DATA_ODOMETER), "div64" },
+    { 0x106, 8, 0, 2, BIKE_SIG_BIG_ENDIAN,   -3,   2,     0, BIKE_FIELD(odometer, BIKE_FIELD_U32, BIKE_DATA_ODOMETER), "div64_neg" },
+};
+static constexpr BikeCANDecoder<scaling_signals> scaling_decoder;
+
+static bool checkScaling(size_t count) {
+    static const char *const names[] = { "add", "shift", "mul_div32", "mul_div64" };
+    for (size_t s = 0; s < sizeof(scaling_signals) / sizeof(scaling_signals[0]); s++) {
+        const bike_can_signal_t &sig = scaling_signals[s];
+        printf("  %-10s %s\n", sig.name, names[scaling_decoder.math(s)]);
+        for (size_t i = 0; i < count; i++) {
+            can_frame_t frame;
+            memset(&frame, 0, sizeof(frame));
+            frame.rxId = sig.id;
+            frame.len = sig.dlc;
+            for (size_t b = 0; b < 8; b++) {
+                frame.rxBuf[b] = (uint8_t)rng();
+            }
+            if (i < 2) {
+                memset(frame.rxBuf, i ? 0xff : 0x00, sizeof(frame.rxBuf));     // Both ends of the range
+            }
+
+            uint32_t raw = 0;
+            for (uint8_t b = 0; b < sig.length; b++) {
+                uint8_t byte = (sig.order == BIKE_SIG_BIG_ENDIAN) ? frame.rxBuf[sig.byte_offset + b] : frame.rxBuf[sig.byte_offset + sig.length - 1 - b];
+                raw = (raw << 8) | byte;
+            }
+            int64_t expected = (int64_t)raw * sig.mul / sig.div + sig.offset;
+
+            bike_data_t data;
+            memset(&data, 0, sizeof(data));
+            scaling_decoder.decode(frame, data);
+            bool ok = (sig.field_type == BIKE_FIELD_U8) ? data.pas_level == (uint8_t)expected : data.odometer == (uint32_t)expected;
+            if (!ok) {
+                printf("MISMATCH %s raw=%u\n", sig.name, raw);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+template <typename F>
+static double timeFrames(const can_frame_t *frames, size_t count, F decode) {
+    double best = 1e9;
+    for (int run = 0; run < 5; run++) {
+        bike_data_t data;
+        memset(&data, 0, sizeof(data));
+        volatile uint32_t hits = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < count; i++) {
+            hits = hits + decode(frames[i], data);
+        }
+        auto end = std::chrono::steady_clock::now();
+        volatile uint32_t sink = data.odometer;
+        (void)sink;
+        double ns = std::chrono::duration<double, std::nano>(end - start).count() / (double)count;
+        if (ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    size_t count = (argc > 1) ? strtoul(argv[1], nullptr, 0) : 1000000;
+    can_frame_t *frames = new can_frame_t[count];
+    makeFrames(frames, count);
+
+    bike_data_t a, b;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    for (size_t i = 0; i < count; i++) {
+        bool ra = decoder.decode(frames[i], a);
+        bool rb = decodeSwitch(frames[i], b);
+        if (ra != rb || !sameValues(a, b)) {
+            printf("MISMATCH at frame %zu: id 0x%lx len %u\n", i, frames[i].rxId, frames[i].len);
+            return 1;
+        }
+    }
+    printf("%zu frames: table matches switch\n", count);
+
+    printf("Integer scaling:\n");
+    if (!checkScaling(count / 10)) {
+        return 1;
+    }
+    printf("Integer scaling matches 64-bit math\n");
+
+    double t_switch = timeFrames(frames, count, decodeSwitch);
+    double t_table = timeFrames(frames, count, [](const can_frame_t &frame, bike_data_t &data) {
+        return decoder.decode(frame, data);
+    });
+    printf("switch %.1f ns/frame, table %.1f ns/frame\n", t_switch, t_table);
+
+    delete[] frames;
+    return 0;
+}